@@ -0,0 +1,120 @@
+#include <iostream>
+#include <new>
+#include <cstdlib>
+#include "net-headers/net_framework.h"
+
+// Counts heap allocations and body buffer allocations per request/response round trip
+// over loopback. Each round trip is run twice: once passing messages by const reference
+// (every hop copies the message) and once moving them (the body is allocated once).
+
+// Every call to the global operator new is counted
+static std::atomic<uint64_t> nHeapAllocations{ 0 };
+
+// The replacements go through this pair rather than calling malloc and free directly,
+// otherwise GCC sees free() given a pointer from operator new once they are inlined
+[[gnu::noinline]] static void* HeapAllocate(std::size_t nSize){
+	nHeapAllocations.fetch_add(1, std::memory_order_relaxed);
+	return std::malloc(nSize);
+}
+
+[[gnu::noinline]] static void HeapRelease(void* p){
+	std::free(p);
+}
+
+void* operator new(std::size_t nSize){
+	if (void* p = HeapAllocate(nSize))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept{
+	HeapRelease(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept{
+	HeapRelease(p);
+}
+
+enum class BenchMsgTypes : uint32_t{
+	EchoCopy,
+	EchoMove
+};
+
+// Large enough to live in a pooled block rather than inline in the message
+struct Payload{
+	uint8_t data[256];
+};
+
+class EchoServer : public server_interface<BenchMsgTypes>{
+public:
+	EchoServer(uint16_t nPort) : server_interface<BenchMsgTypes>(nPort){
+
+	}
+
+protected:
+	virtual void OnMessage(std::shared_ptr<connection<BenchMsgTypes>> client, message<BenchMsgTypes>& msg){
+		if (msg.header.id == BenchMsgTypes::EchoCopy)
+			client->Send(msg);
+		else
+			client->Send(std::move(msg));
+	}
+};
+
+struct RoundTripStats{
+	double dHeapPerTrip;
+	double dBodyPerTrip;
+};
+
+RoundTripStats RunRoundTrips(EchoServer& server, client_interface<BenchMsgTypes>& client, BenchMsgTypes id, int nTrips){
+	Payload payload{};
+	buffer_pool_stats before = buffer_pool::instance().stats();
+	uint64_t nHeapBefore = nHeapAllocations.load();
+
+	for (int i = 0; i < nTrips; i++){
+		message<BenchMsgTypes> msg;
+		msg.header.id = id;
+		msg << payload;
+
+		if (id == BenchMsgTypes::EchoCopy)
+			client.Send(msg);
+		else
+			client.Send(std::move(msg));
+
+		// Serve the request, then wait for the echo
+		server.Update(1, true);
+		client.Wait();
+		auto reply = client.Incoming().pop_front();
+	}
+
+	buffer_pool_stats after = buffer_pool::instance().stats();
+	uint64_t nBody = (after.nHits + after.nMisses) - (before.nHits + before.nMisses);
+	uint64_t nHeap = nHeapAllocations.load() - nHeapBefore;
+	return { double(nHeap) / nTrips, double(nBody) / nTrips };
+}
+
+int main(){
+	const int nTrips = 10000;
+
+	EchoServer server(60100);
+	server.Start();
+
+	client_interface<BenchMsgTypes> client;
+	client.Connect("127.0.0.1", 60100);
+	while (!client.IsConnected())
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	// Let the handshake finish and the pool warm up before measuring
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	RunRoundTrips(server, client, BenchMsgTypes::EchoMove, 1000);
+
+	RoundTripStats copy = RunRoundTrips(server, client, BenchMsgTypes::EchoCopy, nTrips);
+	RoundTripStats move = RunRoundTrips(server, client, BenchMsgTypes::EchoMove, nTrips);
+
+	std::cout << "Round trips: " << nTrips << ", payload: " << sizeof(Payload) << " bytes\n";
+	std::cout << "  by copy: " << copy.dHeapPerTrip << " heap allocations, " << copy.dBodyPerTrip << " body allocations per round trip\n";
+	std::cout << "  by move: " << move.dHeapPerTrip << " heap allocations, " << move.dBodyPerTrip << " body allocations per round trip\n";
+
+	client.Disconnect();
+	server.Stop();
+	return 0;
+}
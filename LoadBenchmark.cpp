@@ -0,0 +1,463 @@
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <string>
+#ifdef __unix__
+#include <sys/resource.h>
+#endif
+#include "net-headers/net_framework.h"
+
+// Load generator and latency benchmark. Opens many client_interface connections to a
+// server in the same process over loopback, drives them from a few threads with a mix
+// of request types and reports throughput and round trip latency percentiles.
+//
+//   LoadBenchmark [--clients N] [--drivers N] [--server-threads N] [--sharded]
+//                 [--handler-threads N] [--path-work US] [--seconds S] [--warmup S] [--window N] [--payload BYTES]
+//                 [--mix PING,FANOUT,PATH] [--path-length N] [--port N]
+//
+// Request types, picked at random with the --mix weights:
+//   ping    the server echoes the message back
+//   fanout  the server sends the message to every client (MessageAllClients), the
+//           latency is recorded by every client that receives it
+//   path    the client requests a path and the server answers with one goal per
+//           request, --path-length goals and then a done message. --path-work
+//           spins the handler for that many microseconds per request, standing in
+//           for a path planner, which is what --handler-threads spreads out
+
+enum class BenchMsgTypes : uint32_t{
+	Ready,
+	Ping,
+	FanOut,
+	PathRequest,
+	PathGoal,
+	PathDone
+};
+
+struct BenchConfig{
+	uint16_t nPort = 60200;
+	size_t nClients = 1000;
+	size_t nDrivers = 4;
+	size_t nServerThreads = 0;
+	bool bSharded = false;
+	// 0 runs OnMessage on the Update() thread
+	size_t nHandlerThreads = 0;
+	uint32_t nPathWorkUs = 0;
+	double dSeconds = 10.0;
+	double dWarmup = 1.0;
+	// Requests each client keeps outstanding
+	size_t nWindow = 1;
+	// Extra body bytes carried by every request
+	size_t nPayload = 32;
+	uint32_t nPingWeight = 90;
+	uint32_t nFanOutWeight = 1;
+	uint32_t nPathWeight = 9;
+	uint32_t nPathLength = 5;
+};
+
+static uint64_t NowNs(){
+	return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+class BenchServer : public server_interface<BenchMsgTypes>{
+public:
+	BenchServer(const BenchConfig& config)
+		: server_interface<BenchMsgTypes>(config.nPort, config.nServerThreads, config.bSharded ? threading::sharded : threading::pool), m_nPathWorkUs(config.nPathWorkUs){
+		if (config.nHandlerThreads > 0)
+			SetHandlerThreads(config.nHandlerThreads);
+	}
+
+	// The handler threads use m_nPathWorkUs, stop them before it goes
+	~BenchServer(){
+		StopHandlers();
+	}
+
+protected:
+	// Tell the client the server has validated it. Clients could send straight away,
+	// but the drivers wait for this so the connect time covers the whole handshake and
+	// the measurement only starts once every client is fully connected.
+	virtual void OnClientValidated(std::shared_ptr<connection<BenchMsgTypes>> client){
+		message<BenchMsgTypes> msg;
+		msg.header.id = BenchMsgTypes::Ready;
+		client->Send(std::move(msg));
+	}
+
+	virtual void OnMessage(std::shared_ptr<connection<BenchMsgTypes>> client, message<BenchMsgTypes>& msg){
+		switch (msg.header.id){
+			case BenchMsgTypes::Ping:{
+				client->Send(std::move(msg));
+			}
+			break;
+
+			case BenchMsgTypes::FanOut:{
+				MessageAllClients(std::move(msg));
+			}
+			break;
+
+			case BenchMsgTypes::PathRequest:{
+				// The request says how many goals are left on the path
+				uint32_t nRemaining = 0;
+				msg >> nRemaining;
+
+				// Stand in for planning the path
+				auto tWorkEnd = std::chrono::steady_clock::now() + std::chrono::microseconds(m_nPathWorkUs);
+				while (std::chrono::steady_clock::now() < tWorkEnd){}
+
+				if (nRemaining > 0){
+					msg.header.id = BenchMsgTypes::PathGoal;
+					nRemaining--;
+				}
+				else{
+					msg.header.id = BenchMsgTypes::PathDone;
+				}
+				msg << nRemaining;
+				client->Send(std::move(msg));
+			}
+			break;
+
+			default:
+			break;
+		}
+	}
+
+private:
+	uint32_t m_nPathWorkUs = 0;
+};
+
+// One benchmark connection, only ever touched by the driver thread that owns it
+struct BenchClient{
+	client_interface<BenchMsgTypes> client;
+	uint32_t nIndex = 0;
+	bool bReady = false;
+	size_t nOutstanding = 0;
+};
+
+// What one driver thread measured
+struct DriverStats{
+	uint64_t nMessagesSent = 0;
+	uint64_t nMessagesReceived = 0;
+	uint64_t nBytesSent = 0;
+	uint64_t nBytesReceived = 0;
+	latency_histogram<> histPing;
+	latency_histogram<> histFanOut;
+	latency_histogram<> histPath;
+};
+
+struct BenchState{
+	std::atomic<size_t> nReadyClients{ 0 };
+	std::atomic<bool> bGo{ false };
+	std::atomic<bool> bRecord{ false };
+	std::atomic<bool> bStop{ false };
+};
+
+class Driver{
+public:
+	Driver(const BenchConfig& config, BenchState& state, uint32_t nSeed)
+		: m_config(config), m_state(state), m_rng(nSeed){
+
+	}
+
+	// Must be called before the client connects, so its incoming queue wakes this
+	// driver from the first message on
+	void Add(BenchClient* pClient){
+		pClient->client.Incoming().attach(&m_signalIncoming);
+		m_vClients.push_back(pClient);
+	}
+
+	void Run(){
+		while (!m_state.bStop.load(std::memory_order_relaxed)){
+			bool bProgress = false;
+			bool bGo = m_state.bGo.load(std::memory_order_relaxed);
+			m_bRecord = m_state.bRecord.load(std::memory_order_relaxed);
+
+			for (BenchClient* pClient : m_vClients){
+				while (!pClient->client.Incoming().empty()){
+					owned_message<BenchMsgTypes> in = pClient->client.Incoming().pop_front();
+					Handle(*pClient, in.msg);
+					bProgress = true;
+				}
+
+				if (bGo && pClient->bReady){
+					while (pClient->nOutstanding < m_config.nWindow){
+						StartRequest(*pClient);
+						bProgress = true;
+					}
+				}
+			}
+
+			// Every window is full, sleep until a response arrives rather than spinning
+			// and taking CPU from the server and client io threads being measured. The
+			// timeout picks up the start and stop flags.
+			if (!bProgress)
+				m_signalIncoming.wait_for([this]{ return HasIncoming(); }, std::chrono::milliseconds(1));
+		}
+	}
+
+	DriverStats& Stats(){
+		return m_stats;
+	}
+
+private:
+	bool HasIncoming(){
+		for (BenchClient* pClient : m_vClients)
+			if (!pClient->client.Incoming().empty())
+				return true;
+		return false;
+	}
+
+	void StartRequest(BenchClient& c){
+		uint32_t nPick = std::uniform_int_distribution<uint32_t>(0, m_nTotalWeight - 1)(m_rng);
+		if (nPick < m_config.nPingWeight){
+			message<BenchMsgTypes> msg = MakeRequest(BenchMsgTypes::Ping);
+			Send(c, std::move(msg));
+		}
+		else if (nPick < m_config.nPingWeight + m_config.nFanOutWeight){
+			// The sender's index lets it recognise its own copy of the broadcast
+			message<BenchMsgTypes> msg = MakeRequest(BenchMsgTypes::FanOut);
+			msg << c.nIndex;
+			Send(c, std::move(msg));
+		}
+		else{
+			SendPathRequest(c, m_config.nPathLength);
+		}
+		c.nOutstanding++;
+	}
+
+	void SendPathRequest(BenchClient& c, uint32_t nRemaining){
+		message<BenchMsgTypes> msg = MakeRequest(BenchMsgTypes::PathRequest);
+		msg << nRemaining;
+		Send(c, std::move(msg));
+	}
+
+	// Body is [payload][send time], anything request specific goes on top
+	message<BenchMsgTypes> MakeRequest(BenchMsgTypes id){
+		message<BenchMsgTypes> msg;
+		msg.header.id = id;
+		msg.body.resize(m_config.nPayload);
+		msg << NowNs();
+		return msg;
+	}
+
+	void Send(BenchClient& c, message<BenchMsgTypes>&& msg){
+		if (m_bRecord){
+			m_stats.nMessagesSent++;
+			m_stats.nBytesSent += sizeof(message_header<BenchMsgTypes>) + msg.body.size();
+		}
+		c.client.Send(std::move(msg));
+	}
+
+	void Handle(BenchClient& c, message<BenchMsgTypes>& msg){
+		if (msg.header.id == BenchMsgTypes::Ready){
+			c.bReady = true;
+			m_state.nReadyClients.fetch_add(1);
+			return;
+		}
+
+		if (m_bRecord){
+			m_stats.nMessagesReceived++;
+			m_stats.nBytesReceived += sizeof(message_header<BenchMsgTypes>) + msg.body.size();
+		}
+
+		uint64_t nSentAt = 0;
+		switch (msg.header.id){
+			case BenchMsgTypes::Ping:{
+				msg >> nSentAt;
+				Record(m_stats.histPing, nSentAt);
+				c.nOutstanding--;
+			}
+			break;
+
+			case BenchMsgTypes::FanOut:{
+				uint32_t nSender = 0;
+				msg >> nSender >> nSentAt;
+				Record(m_stats.histFanOut, nSentAt);
+				if (nSender == c.nIndex)
+					c.nOutstanding--;
+			}
+			break;
+
+			case BenchMsgTypes::PathGoal:
+			case BenchMsgTypes::PathDone:{
+				uint32_t nRemaining = 0;
+				msg >> nRemaining >> nSentAt;
+				Record(m_stats.histPath, nSentAt);
+				if (msg.header.id == BenchMsgTypes::PathGoal)
+					SendPathRequest(c, nRemaining);
+				else
+					c.nOutstanding--;
+			}
+			break;
+
+			default:
+			break;
+		}
+	}
+
+	void Record(latency_histogram<>& hist, uint64_t nSentAt){
+		if (m_bRecord)
+			hist.record(NowNs() - nSentAt);
+	}
+
+private:
+	const BenchConfig& m_config;
+	BenchState& m_state;
+	std::vector<BenchClient*> m_vClients;
+	// Notified by the incoming queue of every client this driver owns
+	queue_signal m_signalIncoming;
+	std::mt19937 m_rng;
+	uint32_t m_nTotalWeight = std::max<uint32_t>(m_config.nPingWeight + m_config.nFanOutWeight + m_config.nPathWeight, 1);
+	bool m_bRecord = false;
+	DriverStats m_stats;
+};
+
+static bool ParseArgs(int argc, char* argv[], BenchConfig& config){
+	for (int i = 1; i < argc; i++){
+		std::string sArg = argv[i];
+		if (sArg == "--sharded"){
+			config.bSharded = true;
+			continue;
+		}
+		if (i + 1 >= argc){
+			std::cerr << "Missing value for " << sArg << "\n";
+			return false;
+		}
+
+		std::string sValue = argv[++i];
+		if (sArg == "--clients") config.nClients = std::stoul(sValue);
+		else if (sArg == "--drivers") config.nDrivers = std::max<size_t>(std::stoul(sValue), 1);
+		else if (sArg == "--server-threads") config.nServerThreads = std::stoul(sValue);
+		else if (sArg == "--handler-threads") config.nHandlerThreads = std::stoul(sValue);
+		else if (sArg == "--path-work") config.nPathWorkUs = uint32_t(std::stoul(sValue));
+		else if (sArg == "--seconds") config.dSeconds = std::stod(sValue);
+		else if (sArg == "--warmup") config.dWarmup = std::stod(sValue);
+		else if (sArg == "--window") config.nWindow = std::max<size_t>(std::stoul(sValue), 1);
+		else if (sArg == "--payload") config.nPayload = std::stoul(sValue);
+		else if (sArg == "--path-length") config.nPathLength = uint32_t(std::stoul(sValue));
+		else if (sArg == "--port") config.nPort = uint16_t(std::stoul(sValue));
+		else if (sArg == "--mix"){
+			if (std::sscanf(sValue.c_str(), "%u,%u,%u", &config.nPingWeight, &config.nFanOutWeight, &config.nPathWeight) != 3){
+				std::cerr << "--mix expects PING,FANOUT,PATH weights\n";
+				return false;
+			}
+		}
+		else{
+			std::cerr << "Unknown option " << sArg << "\n";
+			return false;
+		}
+	}
+	return true;
+}
+
+static void PrintLatency(const char* sName, const latency_histogram<>& hist){
+	std::cout << "  " << std::left << std::setw(8) << sName << std::right
+		<< std::setw(12) << hist.count()
+		<< std::setw(10) << hist.percentile(50.0) / 1000.0
+		<< std::setw(10) << hist.percentile(99.0) / 1000.0
+		<< std::setw(10) << hist.percentile(99.9) / 1000.0
+		<< std::setw(10) << hist.max() / 1000.0 << "\n";
+}
+
+int main(int argc, char* argv[]){
+	BenchConfig config;
+	if (!ParseArgs(argc, argv, config))
+		return 1;
+
+#ifdef __unix__
+	// Both ends of every connection live in this process, as does each client's own
+	// io_context, so thousands of clients need far more descriptors than the usual 1024
+	rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0){
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+#endif
+
+	BenchServer server(config);
+	server.Start();
+
+	std::atomic<bool> bServing{ true };
+	std::thread thrUpdate([&](){
+		while (bServing)
+			server.UpdateFor(size_t(-1), std::chrono::milliseconds(10));
+	});
+
+	// Spread the clients over the driver threads
+	BenchState state;
+	std::vector<std::unique_ptr<Driver>> vDrivers;
+	for (size_t i = 0; i < config.nDrivers; i++)
+		vDrivers.push_back(std::make_unique<Driver>(config, state, uint32_t(i + 1)));
+
+	auto tConnectStart = std::chrono::steady_clock::now();
+	std::vector<std::unique_ptr<BenchClient>> vClients;
+	for (size_t i = 0; i < config.nClients; i++){
+		vClients.push_back(std::make_unique<BenchClient>());
+		vClients.back()->nIndex = uint32_t(i);
+		vDrivers[i % config.nDrivers]->Add(vClients.back().get());
+		vClients.back()->client.Connect("127.0.0.1", config.nPort);
+	}
+
+	std::vector<std::thread> vDriverThreads;
+	for (auto& driver : vDrivers)
+		vDriverThreads.emplace_back([&driver](){ driver->Run(); });
+
+	// Every client has to finish its handshake before the load starts
+	while (state.nReadyClients.load() < config.nClients){
+		if (std::chrono::steady_clock::now() - tConnectStart > std::chrono::seconds(60)){
+			std::cerr << "Only " << state.nReadyClients.load() << " of " << config.nClients << " clients connected\n";
+			break;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	double dConnectSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tConnectStart).count();
+
+	state.bGo = true;
+	std::this_thread::sleep_for(std::chrono::duration<double>(config.dWarmup));
+
+	state.bRecord = true;
+	auto tStart = std::chrono::steady_clock::now();
+	std::this_thread::sleep_for(std::chrono::duration<double>(config.dSeconds));
+	state.bRecord = false;
+	double dElapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+
+	state.bStop = true;
+	for (auto& thread : vDriverThreads)
+		thread.join();
+
+	DriverStats total;
+	for (auto& driver : vDrivers){
+		DriverStats& s = driver->Stats();
+		total.nMessagesSent += s.nMessagesSent;
+		total.nMessagesReceived += s.nMessagesReceived;
+		total.nBytesSent += s.nBytesSent;
+		total.nBytesReceived += s.nBytesReceived;
+		total.histPing.merge(s.histPing);
+		total.histFanOut.merge(s.histFanOut);
+		total.histPath.merge(s.histPath);
+	}
+
+	std::cout << std::fixed << std::setprecision(1);
+	std::cout << "\nClients: " << state.nReadyClients.load() << " on " << config.nDrivers << " driver threads, connected in " << dConnectSeconds << " s\n";
+	std::cout << "Server: " << (config.bSharded ? "sharded" : "pool") << ", " << (config.nServerThreads ? std::to_string(config.nServerThreads) : std::string("default")) << " io threads";
+	if (config.nHandlerThreads > 0)
+		std::cout << ", " << config.nHandlerThreads << " handler threads";
+	std::cout << "\n";
+	std::cout << "Mix (ping,fanout,path): " << config.nPingWeight << "," << config.nFanOutWeight << "," << config.nPathWeight
+		<< "  window: " << config.nWindow << "  payload: " << config.nPayload << " bytes  path length: " << config.nPathLength << "\n";
+	std::cout << "Measured: " << dElapsed << " s\n";
+	std::cout << "  sent:     " << total.nMessagesSent << " msgs, " << total.nMessagesSent / dElapsed << " msgs/s, "
+		<< total.nBytesSent / dElapsed / (1024.0 * 1024.0) << " MB/s\n";
+	std::cout << "  received: " << total.nMessagesReceived << " msgs, " << total.nMessagesReceived / dElapsed << " msgs/s, "
+		<< total.nBytesReceived / dElapsed / (1024.0 * 1024.0) << " MB/s\n";
+	std::cout << "Latency (us)     count       p50       p99      p999       max\n";
+	PrintLatency("ping", total.histPing);
+	PrintLatency("fanout", total.histFanOut);
+	PrintLatency("path", total.histPath);
+
+	for (auto& c : vClients)
+		c->client.Disconnect();
+
+	bServing = false;
+	thrUpdate.join();
+	server.Stop();
+	return 0;
+}
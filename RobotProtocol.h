@@ -0,0 +1,71 @@
+#pragma once
+#include "net-headers/net_framework.h"
+
+// Messages exchanged by SimpleServer and SimpleClient, shared so both ends always
+// agree on the ids and on what each message carries
+enum class CustomMsgTypes : uint32_t{
+	ServerAccept,
+	ServerDeny,
+	ServerPing,
+	MessageAll,
+	ServerMessage,
+	ServerNewGoal,
+	ServerNewPath,
+	ServerPathDone,
+	ServerCharge,
+	RobotGoalRequest,
+	RobotLowBattery,
+	RobotPathRequest,
+	RobotPathDone
+};
+
+// A point on a path
+struct Goal{
+	float x;
+	float y;
+};
+
+// A cell on the map, for goals and charging stations
+struct GridPoint{
+	uint32_t x;
+	uint32_t y;
+};
+
+struct PingPayload{
+	std::chrono::system_clock::time_point timeSent;
+};
+
+struct ClientIdPayload{
+	uint32_t nClientID;
+};
+
+NET_MESSAGE_PAYLOAD(CustomMsgTypes::ServerAccept, no_payload);
+NET_MESSAGE_PAYLOAD(CustomMsgTypes::ServerDeny, no_payload);
+NET_MESSAGE_PAYLOAD(CustomMsgTypes::ServerPing, PingPayload);
+NET_MESSAGE_PAYLOAD(CustomMsgTypes::MessageAll, no_payload);
+NET_MESSAGE_PAYLOAD(CustomMsgTypes::ServerMessage, ClientIdPayload);
+NET_MESSAGE_PAYLOAD(CustomMsgTypes::ServerNewGoal, GridPoint);
+// A uint32_t point count followed by that many Goals
+NET_MESSAGE_PAYLOAD(CustomMsgTypes::ServerNewPath, variable_payload);
+NET_MESSAGE_PAYLOAD(CustomMsgTypes::ServerPathDone, no_payload);
+NET_MESSAGE_PAYLOAD(CustomMsgTypes::ServerCharge, GridPoint);
+NET_MESSAGE_PAYLOAD(CustomMsgTypes::RobotGoalRequest, no_payload);
+NET_MESSAGE_PAYLOAD(CustomMsgTypes::RobotLowBattery, no_payload);
+NET_MESSAGE_PAYLOAD(CustomMsgTypes::RobotPathRequest, no_payload);
+NET_MESSAGE_PAYLOAD(CustomMsgTypes::RobotPathDone, no_payload);
+
+// Messages the server handles
+using ServerDispatch = message_dispatch<CustomMsgTypes,
+	CustomMsgTypes::ServerPing,
+	CustomMsgTypes::MessageAll,
+	CustomMsgTypes::RobotGoalRequest,
+	CustomMsgTypes::RobotLowBattery,
+	CustomMsgTypes::RobotPathRequest,
+	CustomMsgTypes::RobotPathDone>;
+
+// Messages the client handles, path replies are read by the request that asked for them
+using ClientDispatch = message_dispatch<CustomMsgTypes,
+	CustomMsgTypes::ServerAccept,
+	CustomMsgTypes::ServerMessage,
+	CustomMsgTypes::ServerNewGoal,
+	CustomMsgTypes::ServerCharge>;
@@ -1,146 +1,131 @@
 #include <iostream>
-#include "net-headers/net_framework.h"
-
-enum class CustomMsgTypes : uint32_t{
-	ServerAccept,
-	ServerDeny,
-	ServerPing,
-	MessageAll,
-	ServerMessage,
-	ServerNewGoal,
-	ServerNewPath,
-	ServerPathDone,
-	ServerCharge,
-	RobotGoalRequest,
-	RobotLowBattery,
-	RobotPathRequest,
-};
+#include "RobotProtocol.h"
 
 class CustomClient : public client_interface<CustomMsgTypes>{
 public:
 	int battery = 170;
-	void PingServer(){
-		message<CustomMsgTypes> msg;
-		msg.header.id = CustomMsgTypes::ServerPing;
+	// Set when the robot is ready for its next path
+	bool bWantPath = false;
 
+	void PingServer(){
 		// Caution with this...
-		std::chrono::system_clock::time_point timeNow = std::chrono::system_clock::now();		
-
-		msg << timeNow;
-		Send(msg);
+		Send(make_message<CustomMsgTypes::ServerPing>({ std::chrono::system_clock::now() }));
 	}
 
 	void MessageAll(){
-		message<CustomMsgTypes> msg;
-		msg.header.id = CustomMsgTypes::MessageAll;		
-		Send(msg);
+		Send(make_message<CustomMsgTypes::MessageAll>());
 	}
 
 	void RequestGoal(){
-		message<CustomMsgTypes> msg;
 		std::cout << "Reached goal, requesting new one." << std::endl;
-		msg.header.id = CustomMsgTypes::RobotGoalRequest;
-		Send(msg);
+		Send(make_message<CustomMsgTypes::RobotGoalRequest>());
 	}	
 
 	void RequestStation(){
-		message<CustomMsgTypes> msg;
 		std::cout << "Low battery, requesting a charging station location." << std::endl;
-		msg.header.id = CustomMsgTypes::RobotLowBattery;
-		Send(msg);
+		Send(make_message<CustomMsgTypes::RobotLowBattery>());
 	}
 
-	void RequestPath(){
-		message<CustomMsgTypes> msg;
+	// Fetch a whole path in one round trip, the server sends every point in a single
+	// message. Empty if the server did not answer.
+	std::vector<Goal> RequestPath(){
 		std::cout << "Requesting new path." << std::endl;
-		msg.header.id = CustomMsgTypes::RobotPathRequest;
-		Send(msg);
+		std::future<message<CustomMsgTypes>> reply = Request(make_message<CustomMsgTypes::RobotPathRequest>(), std::chrono::seconds(5));
+
+		std::vector<Goal> path;
+		try{
+			message<CustomMsgTypes> msg = reply.get();
+			if (msg.header.id == CustomMsgTypes::ServerNewPath){
+				// Read the points in place, straight out of the message
+				message_view<CustomMsgTypes> view(msg);
+				uint32_t nPoints = 0;
+				view >> nPoints;
+				auto points = view.read_span<Goal>(nPoints);
+				if (view)
+					path.assign(points.begin(), points.end());
+			}
+		}
+		catch (request_error& e){
+			std::cout << "Path request failed: " << e.what() << std::endl;
+		}
+
+		for (const Goal& g : path)
+			std::cout << "Adding (" << g.x << "," << g.y << ")" << std::endl;
+		return path;
+	}
+
+protected:
+	// Called by Update() for each message from the server, hands it to the typed
+	// handler for its id
+	void OnMessage(message<CustomMsgTypes>& msg) override{
+		if (ClientDispatch::dispatch(*this, msg) != dispatch_result::handled)
+			std::cout << "Unexpected message " << int(msg.header.id) << std::endl;
+	}
+
+	void OnDisconnect() override{
+		std::cout << "Server Down" << std::endl;
+	}
+
+private:
+	// The dispatch table calls the handlers below
+	friend ClientDispatch;
+
+	void OnPayload(message_tag<CustomMsgTypes::ServerAccept>, const no_payload&, message<CustomMsgTypes>&){
+		std::cout << "Server Accepted Connection\n";
+		bWantPath = true;
+	}
+
+	void OnPayload(message_tag<CustomMsgTypes::ServerMessage>, const ClientIdPayload& hello, message<CustomMsgTypes>&){
+		std::cout << "Hello from [" << hello.nClientID << "]\n";
+	}
+
+	void OnPayload(message_tag<CustomMsgTypes::ServerNewGoal>, const GridPoint& goal, message<CustomMsgTypes>&){
+		std::cout << "New goal is: (" << goal.x << "," << goal.y << ")" << std::endl;
+		sleep(4);
+		if(battery <= 10){
+			RequestStation();
+		}
+		else{
+			bWantPath = true;
+		}
+	}
+
+	void OnPayload(message_tag<CustomMsgTypes::ServerCharge>, const GridPoint& station, message<CustomMsgTypes>&){
+		std::cout << "Charging station is: (" << station.x << "," << station.y << ")" << std::endl;
+		sleep(2);
+		std::cout<< "Charging..." << std::endl;
+		sleep(6);
+		battery = 170;
+		bWantPath = true;
 	}
 };
 
 int main(){
-	uint32_t currentX, currentY;
 	CustomClient c;
-	std::vector<int> goals;
 	c.Connect("127.0.0.1", 60000);	
-	while(true){				
-		if (c.IsConnected()){				
-			if (!c.Incoming().empty()){
-
-				auto msg = c.Incoming().pop_front().msg;
-
-				switch (msg.header.id){
-					case CustomMsgTypes::ServerAccept:{
-						// Server has responded to a ping request				
-						std::cout << "Server Accepted Connection\n";
-						c.RequestPath();
-					}
-					break;
-					case CustomMsgTypes::ServerMessage:{
-						// Server has responded to a ping request	
-						uint32_t clientID;
-						msg >> clientID;
-						std::cout << "Hello from [" << clientID << "]\n";
-					}
-					break;
-					case CustomMsgTypes::ServerNewGoal:{
-						msg >> currentY >> currentX;
-						std::cout << "New goal is: (" << currentX << "," << currentY << ")" << std::endl;
-						sleep(4);
-						if(c.battery <= 10){
-							c.RequestStation();
-						}
-						else{
-							c.RequestPath();						
-						}					
-					}
-					break;	
-					case CustomMsgTypes::ServerCharge:{
-						msg >> currentY >> currentX;
-						std::cout << "Charging station is: (" << currentX << "," << currentY << ")" << std::endl;
-						sleep(2);
-						std::cout<< "Charging..." << std::endl;
-						sleep(6);
-						c.battery = 170;
-						c.RequestPath();
-					}
-					break;
-
-					case CustomMsgTypes::ServerNewPath:{
-						std::cout << "Receiving path. ";
-						msg >> currentY >> currentX;
-						goals.push_back(currentX);
-						goals.push_back(currentY);
-						std::cout << "Adding (" << currentX << "," << currentY << ")" << std::endl;
-						c.RequestPath();
-					}
-					break;
-
-					case CustomMsgTypes::ServerPathDone:{
-						std::cout << "Received new path, following it now." << std::endl;	
-						std::reverse(goals.begin(), goals.end());															
-						for(int i = 0; i<goals.size(); i+2){
-							currentX = goals.back();
-							goals.pop_back();
-							currentY = goals.back();
-							goals.pop_back();
-							std::cout << "Next goal: (" << currentX << "," << currentY << ")" << std::endl;
-							sleep(4);
-							std::cout << "Reached goal." << std::endl;
-							c.battery -= 10;
-							std::cout << "Battery: " << c.battery << std::endl;
-						}
-						if(c.battery <= 50){
-							c.RequestStation();
-						}
-						else{
-							c.RequestPath();						
-						}	
-					}
-					break;
-				}
+	while (c.IsConnected()){
+		if (c.bWantPath){
+			c.bWantPath = false;
+			std::vector<Goal> path = c.RequestPath();
+			std::cout << "Received new path, following it now." << std::endl;
+			for (const Goal& g : path){
+				std::cout << "Next goal: (" << g.x << "," << g.y << ")" << std::endl;
+				sleep(4);
+				std::cout << "Reached goal." << std::endl;
+				c.battery -= 10;
+				std::cout << "Battery: " << c.battery << std::endl;
 			}
+			if(c.battery <= 50){
+				c.RequestStation();
+			}
+			else{
+				c.bWantPath = true;
+			}
+		}
+		else{
+			// Sleep until the server sends something, then handle it on this thread
+			c.UpdateFor(size_t(-1), std::chrono::seconds(1));
 		}
 	}
 	return 0;		
-}
\ No newline at end of file
+}
@@ -1,26 +1,6 @@
 #include <iostream>
-#include "net-headers/net_framework.h"
-
-enum class CustomMsgTypes : uint32_t{
-	ServerAccept,
-	ServerDeny,
-	ServerPing,
-	MessageAll,
-	ServerMessage,
-	ServerNewGoal,
-	ServerNewPath,
-	ServerPathDone,
-	ServerCharge,
-	RobotGoalRequest,
-	RobotLowBattery,
-	RobotPathRequest,
-	RobotPathDone
-};
-
-struct Goal{
-	float x;
-	float y;
-};
+#include <unordered_map>
+#include "RobotProtocol.h"
 
 // addJaguarGoal(-2.034,5.32,0.25,0.96);
 // addJaguarGoal(3.508,7.143,0.255,0.966);
@@ -34,9 +14,10 @@ struct Goal{
 
 class CustomServer : public server_interface<CustomMsgTypes>{
 public:
-	std::vector<Goal> goals[10000];
-	int pathCounter[10000];
-	int maxPath = 5;
+	// Client IDs are sparse, so per-robot state is keyed by ID. OnClientValidated
+	// runs on the io threads while OnMessage runs in Update(), hence the lock.
+	std::mutex muxGoals;
+	std::unordered_map<uint32_t, std::vector<Goal>> goals;
 	CustomServer(uint16_t nPort) : server_interface<CustomMsgTypes>(nPort){
 
 	}
@@ -47,11 +28,8 @@ protected:
 	}
 
 	void OnClientValidated(std::shared_ptr<connection<CustomMsgTypes>> client){
-		message<CustomMsgTypes> msg;
-		msg.header.id = CustomMsgTypes::ServerAccept;
-		client->Send(msg);
-		std::cout << "id: " << client->GetID() << std::endl;
-		pathCounter[client->GetID()] = maxPath;
+		client->Send(make_message<CustomMsgTypes::ServerAccept>());
+		NET_LOG_INFO("id: " << client->GetID());
 		std::vector<Goal> vg;
 		Goal g;
 		g.x = -2.034;
@@ -70,96 +48,88 @@ protected:
 		g.y = 21.31;
 		vg.push_back(g);
 		std::reverse(vg.begin(), vg.end());
+
+		std::scoped_lock lock(muxGoals);
 		goals[client->GetID()] = vg;
-		pathCounter[client->GetID()] = 5;
 	}
 
 	// Called when a client appears to have disconnected
 	virtual void OnClientDisconnect(std::shared_ptr<connection<CustomMsgTypes>> client){
-		std::cout << "Removing client [" << client->GetID() << "]\n";
+		NET_LOG_INFO("Removing client [" << client->GetID() << "]");
+
+		std::scoped_lock lock(muxGoals);
+		goals.erase(client->GetID());
 	}
 
-	// Called when a message arrives
+	// Called when a message arrives, hands it to the typed handler for its id
 	virtual void OnMessage(std::shared_ptr<connection<CustomMsgTypes>> client, message<CustomMsgTypes>& msg){
-		switch (msg.header.id)
+		switch (ServerDispatch::dispatch(*this, msg, client)){
+			case dispatch_result::unknown_id:
+				NET_LOG_WARN("[" << client->GetID() << "]: Unexpected message " << msg.header.id);
+				break;
+			case dispatch_result::bad_size:
+				NET_LOG_WARN("[" << client->GetID() << "]: Malformed message " << msg.header.id << " of " << msg.header.size << " bytes");
+				break;
+			default:
+				break;
+		}
+	}
+
+	// The dispatch table calls the handlers below
+	friend ServerDispatch;
+
+	void OnPayload(message_tag<CustomMsgTypes::ServerPing>, const PingPayload&, message<CustomMsgTypes>& msg, std::shared_ptr<connection<CustomMsgTypes>>& client){
+		NET_LOG_INFO("[" << client->GetID() << "]: Server Ping");
+
+		// Simply bounce message back to client
+		client->Send(std::move(msg));
+	}
+
+	void OnPayload(message_tag<CustomMsgTypes::MessageAll>, const no_payload&, message<CustomMsgTypes>&, std::shared_ptr<connection<CustomMsgTypes>>& client){
+		NET_LOG_INFO("[" << client->GetID() << "]: Message All");
+
+		// Construct a new message and send it to all clients
+		MessageAllClients(make_message<CustomMsgTypes::ServerMessage>({ client->GetID() }), client);
+	}
+
+	void OnPayload(message_tag<CustomMsgTypes::RobotGoalRequest>, const no_payload&, message<CustomMsgTypes>& msg, std::shared_ptr<connection<CustomMsgTypes>>& client){
+		GridPoint goal{ uint32_t(rand() % 100), uint32_t(rand() % 100) };
+		message<CustomMsgTypes> newMsg = make_message<CustomMsgTypes::ServerNewGoal>(goal);
+		newMsg.header.correlation = msg.header.correlation;
+		NET_LOG_INFO("[" << client->GetID() << "]: Robot Reached goal, sending new one. Sending (" << goal.x << "," << goal.y << ")");
+		client->Send(std::move(newMsg));
+	}
+
+	void OnPayload(message_tag<CustomMsgTypes::RobotPathRequest>, const no_payload&, message<CustomMsgTypes>& msg, std::shared_ptr<connection<CustomMsgTypes>>& client){
+		NET_LOG_INFO("[" << client->GetID() << "]: Robot requested a path, sending goals.");
+
+		// The whole route goes out in one message, in the order the robot follows it.
+		// The point count comes first so the robot can read it front to back.
+		std::vector<Goal> path;
 		{
-			case CustomMsgTypes::ServerPing:
-			{
-				std::cout << "[" << client->GetID() << "]: Server Ping\n";
-
-				// Simply bounce message back to client
-				client->Send(msg);
-			}
-			break;
-
-			case CustomMsgTypes::MessageAll:
-			{
-				std::cout << "[" << client->GetID() << "]: Message All\n";
-
-				// Construct a new message and send it to all clients
-				message<CustomMsgTypes> msg;
-				msg.header.id = CustomMsgTypes::ServerMessage;
-				msg << client->GetID();
-				MessageAllClients(msg, client);
-			}
-			break;
-
-			case CustomMsgTypes::RobotGoalRequest:{			
-				std::cout << "[" << client->GetID() << "]: Robot Reached goal, sending new one. ";		
-
-				message<CustomMsgTypes> newMsg;
-				newMsg.header.id = CustomMsgTypes::ServerNewGoal;
-				uint32_t x = rand() % 100;
-				uint32_t y = rand() % 100;
-				newMsg << x << y;		
-				std::cout << "Sending (" << x << "," << y << ")" << std::endl;	
-				client->Send(newMsg);			
-			}
-			break;
-
-			case CustomMsgTypes::RobotPathRequest:{
-				std::cout << "[" << client->GetID() << "]: Robot requested a path, sending goals." << std::endl; 
-
-				message<CustomMsgTypes> newMsg;
-				if(pathCounter[client->GetID()] <= 0){
-					newMsg.header.id = CustomMsgTypes::ServerPathDone;
-					client->Send(newMsg);
-					pathCounter[client->GetID()] = maxPath;
-				}
-				else{
-					newMsg.header.id = CustomMsgTypes::ServerNewPath;					
-					Goal g = goals[client->GetID()].back();
-					goals[client->GetID()].pop_back();
- 					std::cout << "Adding (" << g.x << "," << g.y << ")" << std::endl;
-					float x,y;
-					x = g.x;
-					y = g.y;
-					newMsg << x << y;
-					client->Send(newMsg);
-					pathCounter[client->GetID()] -= 1;				
-				}
-							
-			}
-			break;
-
-			case CustomMsgTypes::RobotPathDone:{
-				std::cout << "[" << client->GetID() << "] Robot has received his path." << std::endl;
-			}
-			break;
-			
-			case CustomMsgTypes::RobotLowBattery:{
-				std::cout << "[" << client->GetID() << "]: Robot is low on battery, sending to charging station. ";
-
-				message<CustomMsgTypes> newMsg;
-				newMsg.header.id = CustomMsgTypes::ServerCharge;
-				uint32_t x = rand() % 10;
-				uint32_t y = rand() % 10;
-				newMsg << x << y;
-				std::cout << "Sending (" << x << "," << y << ")" << std::endl;	
-				client->Send(newMsg);
-			}
-			break;
+			std::scoped_lock lock(muxGoals);
+			path.assign(goals[client->GetID()].rbegin(), goals[client->GetID()].rend());
 		}
+
+		message<CustomMsgTypes> newMsg;
+		newMsg.header.id = CustomMsgTypes::ServerNewPath;
+		// Answer the request it came with
+		newMsg.header.correlation = msg.header.correlation;
+		newMsg << uint32_t(path.size());
+		newMsg.append(path.data(), path.size());
+		client->Send(std::move(newMsg));
+	}
+
+	void OnPayload(message_tag<CustomMsgTypes::RobotPathDone>, const no_payload&, message<CustomMsgTypes>&, std::shared_ptr<connection<CustomMsgTypes>>& client){
+		NET_LOG_INFO("[" << client->GetID() << "] Robot has received his path.");
+	}
+
+	void OnPayload(message_tag<CustomMsgTypes::RobotLowBattery>, const no_payload&, message<CustomMsgTypes>& msg, std::shared_ptr<connection<CustomMsgTypes>>& client){
+		GridPoint station{ uint32_t(rand() % 10), uint32_t(rand() % 10) };
+		message<CustomMsgTypes> newMsg = make_message<CustomMsgTypes::ServerCharge>(station);
+		newMsg.header.correlation = msg.header.correlation;
+		NET_LOG_INFO("[" << client->GetID() << "]: Robot is low on battery, sending to charging station. Sending (" << station.x << "," << station.y << ")");
+		client->Send(std::move(newMsg));
 	}
 };
 
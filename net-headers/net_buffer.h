@@ -0,0 +1,234 @@
+#pragma once
+#include "net_common.h"
+
+// Counters describing how well the buffer pool is serving allocations
+struct buffer_pool_stats{
+    // Allocations served from a free list
+    uint64_t nHits = 0;
+    // Allocations that had to go to the heap
+    uint64_t nMisses = 0;
+    // Blocks handed back and kept for reuse
+    uint64_t nReleases = 0;
+    // Blocks handed back but freed, because they were too large or the free list was full
+    uint64_t nDiscards = 0;
+};
+
+// Size-class buffer pool for message bodies. Blocks are powers of two between 64 bytes
+// and 64KB, each size class keeps a bounded free list of blocks ready to be reused.
+// Requests larger than the biggest class go straight to the heap.
+// Allocation and release may happen on different threads (the asio thread builds the
+// message, the thread calling Update() destroys it), so each class has its own lock.
+class buffer_pool{
+    public:
+        // The pool is shared by every message in the process. It is intentionally never
+        // destroyed, so messages living in static objects can still release into it at exit.
+        static buffer_pool& instance(){
+            static buffer_pool* pool = new buffer_pool();
+            return *pool;
+        }
+
+        buffer_pool(const buffer_pool&) = delete;
+        buffer_pool& operator=(const buffer_pool&) = delete;
+
+    public:
+        // Returns a block of at least nSize bytes, nCapacity receives its real size
+        uint8_t* allocate(size_t nSize, size_t& nCapacity){
+            size_t nClass = SizeClass(nSize);
+            if (nClass >= nClasses){
+                m_nMisses.fetch_add(1, std::memory_order_relaxed);
+                nCapacity = nSize;
+                return static_cast<uint8_t*>(::operator new(nSize));
+            }
+
+            nCapacity = size_t(1) << (nClass + nMinBlockShift);
+            {
+                size_class& sc = m_classes[nClass];
+                std::scoped_lock lock(sc.mux);
+                if (!sc.vFree.empty()){
+                    uint8_t* p = sc.vFree.back();
+                    sc.vFree.pop_back();
+                    m_nHits.fetch_add(1, std::memory_order_relaxed);
+                    return p;
+                }
+            }
+
+            m_nMisses.fetch_add(1, std::memory_order_relaxed);
+            return static_cast<uint8_t*>(::operator new(nCapacity));
+        }
+
+        // Hands a block obtained from allocate() back to the pool
+        void release(uint8_t* p, size_t nCapacity){
+            size_t nClass = SizeClass(nCapacity);
+            if (nClass < nClasses){
+                size_class& sc = m_classes[nClass];
+                std::scoped_lock lock(sc.mux);
+                if (sc.vFree.size() < nMaxFreePerClass){
+                    sc.vFree.push_back(p);
+                    m_nReleases.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+            }
+
+            m_nDiscards.fetch_add(1, std::memory_order_relaxed);
+            ::operator delete(p);
+        }
+
+        buffer_pool_stats stats() const{
+            buffer_pool_stats s;
+            s.nHits = m_nHits.load(std::memory_order_relaxed);
+            s.nMisses = m_nMisses.load(std::memory_order_relaxed);
+            s.nReleases = m_nReleases.load(std::memory_order_relaxed);
+            s.nDiscards = m_nDiscards.load(std::memory_order_relaxed);
+            return s;
+        }
+
+    private:
+        buffer_pool(){
+            for (auto& sc : m_classes)
+                sc.vFree.reserve(nMaxFreePerClass);
+        }
+
+        // Index of the smallest class able to hold nSize bytes
+        static size_t SizeClass(size_t nSize){
+            size_t nClass = 0;
+            while ((size_t(1) << (nClass + nMinBlockShift)) < nSize && nClass < nClasses)
+                nClass++;
+            return nClass;
+        }
+
+    private:
+        static constexpr size_t nMinBlockShift = 6;     // 64 bytes
+        static constexpr size_t nClasses = 11;          // 64 bytes .. 64KB
+        static constexpr size_t nMaxFreePerClass = 1024;
+
+        struct size_class{
+            std::mutex mux;
+            std::vector<uint8_t*> vFree;
+        };
+
+        std::array<size_class, nClasses> m_classes;
+
+        std::atomic<uint64_t> m_nHits{ 0 };
+        std::atomic<uint64_t> m_nMisses{ 0 };
+        std::atomic<uint64_t> m_nReleases{ 0 };
+        std::atomic<uint64_t> m_nDiscards{ 0 };
+};
+
+// Byte storage for a message body. Small bodies live inline in the object itself,
+// larger ones in a block borrowed from the buffer pool, so building, receiving and
+// destroying messages does not hit the heap in the steady state.
+// Behaves like the subset of std::vector<uint8_t> the framework relies on, except that
+// bytes added by resize() are left uninitialised - they are always overwritten anyway.
+class message_body{
+    public:
+        static constexpr size_t nInlineCapacity = 48;
+
+        message_body() = default;
+
+        message_body(const message_body& other){
+            assign(other.begin(), other.end());
+        }
+
+        message_body(message_body&& other) noexcept{
+            steal(other);
+        }
+
+        message_body& operator=(const message_body& other){
+            if (this != &other)
+                assign(other.begin(), other.end());
+            return *this;
+        }
+
+        message_body& operator=(message_body&& other) noexcept{
+            if (this != &other){
+                release();
+                steal(other);
+            }
+            return *this;
+        }
+
+        ~message_body(){
+            release();
+        }
+
+    public:
+        size_t size() const { return m_nSize; }
+        bool empty() const { return m_nSize == 0; }
+        size_t capacity() const { return m_nCapacity; }
+
+        uint8_t* data() { return m_pHeap ? m_pHeap : m_aInline; }
+        const uint8_t* data() const { return m_pHeap ? m_pHeap : m_aInline; }
+
+        uint8_t* begin() { return data(); }
+        uint8_t* end() { return data() + m_nSize; }
+        const uint8_t* begin() const { return data(); }
+        const uint8_t* end() const { return data() + m_nSize; }
+
+        uint8_t& operator[](size_t i) { return data()[i]; }
+        const uint8_t& operator[](size_t i) const { return data()[i]; }
+
+        // Make sure at least nCapacity bytes are available, keeping the contents
+        void reserve(size_t nCapacity){
+            if (nCapacity <= m_nCapacity)
+                return;
+
+            size_t nNewCapacity = 0;
+            uint8_t* pNew = buffer_pool::instance().allocate(nCapacity, nNewCapacity);
+            std::memcpy(pNew, data(), m_nSize);
+            if (m_pHeap)
+                buffer_pool::instance().release(m_pHeap, m_nCapacity);
+
+            m_pHeap = pNew;
+            m_nCapacity = nNewCapacity;
+        }
+
+        // Grow or shrink the body, growth at least doubles the capacity
+        void resize(size_t nSize){
+            if (nSize > m_nCapacity)
+                reserve(std::max(nSize, m_nCapacity * 2));
+            m_nSize = nSize;
+        }
+
+        void clear(){
+            m_nSize = 0;
+        }
+
+        // Replace the contents with the bytes in [first, last)
+        void assign(const uint8_t* first, const uint8_t* last){
+            size_t nSize = size_t(last - first);
+            m_nSize = 0;
+            resize(nSize);
+            if (nSize > 0)
+                std::memcpy(data(), first, nSize);
+        }
+
+    private:
+        void release(){
+            if (m_pHeap)
+                buffer_pool::instance().release(m_pHeap, m_nCapacity);
+            m_pHeap = nullptr;
+            m_nCapacity = nInlineCapacity;
+            m_nSize = 0;
+        }
+
+        // Take the contents of other, leaving it empty. Only valid when this holds no block.
+        void steal(message_body& other){
+            if (other.m_pHeap){
+                m_pHeap = other.m_pHeap;
+                m_nCapacity = other.m_nCapacity;
+                other.m_pHeap = nullptr;
+                other.m_nCapacity = nInlineCapacity;
+            }
+            else{
+                std::memcpy(m_aInline, other.m_aInline, other.m_nSize);
+            }
+            m_nSize = other.m_nSize;
+            other.m_nSize = 0;
+        }
+
+    private:
+        uint8_t* m_pHeap = nullptr;
+        size_t m_nSize = 0;
+        size_t m_nCapacity = nInlineCapacity;
+        alignas(8) uint8_t m_aInline[nInlineCapacity];
+};
@@ -4,13 +4,28 @@
 #include "net_message.h"
 #include "net_tsqueue.h"
 #include "net_connection.h"
+#include <random>
 
 
 template<typename T>
 class client_interface{
-    
     public:
-        client_interface() : m_socket(m_context){
+        // How the client gets back to the server when the connection drops
+        struct reconnect_policy{
+            bool bEnabled = false;
+            // The first attempt waits a random time between half of nInitialDelay and
+            // all of it, and each failed attempt doubles the delay, up to nMaxDelay
+            std::chrono::milliseconds nInitialDelay{ 100 };
+            std::chrono::milliseconds nMaxDelay{ 10000 };
+            // Bytes of messages kept while disconnected, the oldest are dropped
+            // beyond it. 0 is unlimited.
+            size_t nMaxQueuedBytes = 1024 * 1024;
+        };
+
+    public:
+        client_interface()
+            : m_socket(m_context), m_pWheel(std::make_shared<timer_wheel>(std::chrono::milliseconds(50))), m_ticker(m_context, m_pWheel),
+              m_timerReconnect(m_context), m_rng(std::random_device{}()){
             // Initialize the socket with the io context, so it can do stuff
         }
 
@@ -20,42 +35,91 @@ class client_interface{
         }
 
     public:
-        // Connect to server with hostname/ip-address and port
+        // Connect to server with hostname/ip-address and port. Returns true once the
+        // connection is under way, OnConnect() says when it is ready.
         bool Connect(const std::string& host, const uint16_t port){
             try{
-                // Resolve hostname/ip-address into tangible physical address
+                // Resolve hostname/ip-address into tangible physical address. The result
+                // is kept, reconnecting goes straight to it.
                 asio::ip::tcp::resolver resolver(m_context);
-                asio::ip::tcp::resolver::results_type endpoints = resolver.resolve(host, std::to_string(port));
+                m_endpoints = resolver.resolve(host, std::to_string(port));
+                m_bDisconnecting = false;
+                m_nReconnectAttempts = 0;
                 
                 //Create connection
                 m_connection = std::make_unique<connection<T>>(
                     connection<T>::owner::client,
                     m_context,
-                    asio::ip::tcp::socket(m_context), m_qMessagesIn);         
+                    asio::ip::tcp::socket(asio::make_strand(m_context)), m_qMessagesIn);         
+                m_connection->SetWriteLimits(m_nMaxWriteBytes, m_nMaxWriteBuffers);
+                m_connection->SetReadMode(m_nReadMode);
+                m_connection->SetSendLimits(m_sendLimits);
+                m_connection->SetRequestTable(&m_requests);
+                m_connection->SetClient(this);
+                if (m_reconnect.bEnabled)
+                    m_connection->SetHoldWhileClosed(m_reconnect.nMaxQueuedBytes);
 
                 //Tell the connection object to connect to server
-                m_connection->ConnectToServer(endpoints);
+                m_connection->ConnectToServer(m_endpoints);
 
                 // Start context thread
-                thrContext = std::thread([this]() { m_context.run(); });
+                m_ticker.start();
+                if (!thrContext.joinable())
+                    thrContext = std::thread([this]() { m_context.run(); });
             }
             catch (std::exception& e){
-                std::cerr << "Client Exception: " << e.what() << std::endl;
+                NET_LOG_ERROR("Client Exception: " << e.what());
                 return false;
             }
-            return false;
+            return true;
         }
 
         void Disconnect(){
+            // Closing from here on is for good
+            m_bDisconnecting = true;
+
             if(IsConnected()){
                 m_connection->Disconnect();
             }
 
+            m_workGuard.reset();
             m_context.stop();
             if(thrContext.joinable())
                 thrContext.join();
 
-            m_connection.release();
+            // Nothing will answer the requests still in flight
+            m_requests.cancel_all();
+            m_connection.reset();
+
+            // The io thread has stopped, possibly before the socket was closed on it
+            ConnectionClosed();
+        }
+
+        // Limit how many queued bytes/buffers are gathered into one write.
+        // Must be called before Connect().
+        void SetWriteLimits(size_t nMaxBytes, size_t nMaxBuffers){
+            m_nMaxWriteBytes = nMaxBytes;
+            m_nMaxWriteBuffers = nMaxBuffers;
+        }
+
+        // Select how the connection reads incoming messages.
+        // Must be called before Connect().
+        void SetReadMode(typename connection<T>::read_mode mode){
+            m_nReadMode = mode;
+        }
+
+        // Reconnect whenever the connection drops, or an attempt to connect fails.
+        // Messages sent while disconnected are kept, and go out in the same write as
+        // the answer to the new connection's handshake. Only for Connect(), not the
+        // coroutine connect(). Must be called before Connect().
+        void SetReconnect(const reconnect_policy& policy){
+            m_reconnect = policy;
+        }
+
+        // Bound the outgoing queue to the server.
+        // Must be called before Connect().
+        void SetSendLimits(const typename connection<T>::send_limits& limits){
+            m_sendLimits = limits;
         }
 
         // Check if client is actually connected to server
@@ -68,19 +132,171 @@ class client_interface{
 
         // Send message to server
         void Send(const message<T>& msg){
-            if (IsConnected())
+            if (CanSend())
                     m_connection->Send(msg);
         }
 
+        // Send message to server, moving it into the outgoing queue
+        void Send(message<T>&& msg){
+            if (CanSend())
+                    m_connection->Send(std::move(msg));
+        }
+
+        // Send a request and get a future for its response. Any number of requests can be
+        // in flight at once, their responses are matched by the header's correlation id
+        // and never show up in Incoming(). If no response arrives within timeout, or the
+        // client disconnects first, the future throws request_error.
+        std::future<message<T>> Request(message<T>&& msg, std::chrono::milliseconds timeout = std::chrono::seconds(5)){
+            auto pRequest = std::make_shared<pending_request<T>>(m_context);
+            pRequest->bFuture = true;
+            std::future<message<T>> future = pRequest->promise.get_future();
+
+            if (!CanSend()){
+                pRequest->bCancelled = true;
+                pRequest->finish();
+                return future;
+            }
+
+            ArmRequest(pRequest, msg, timeout);
+            m_connection->Send(std::move(msg));
+            return future;
+        }
+
         // Retrieve queue of messages from server
-        tsqueue<owned_message<T>>& Incoming(){ 
+        incoming_queue<T>& Incoming(){ 
             return m_qMessagesIn;
         }
 
+        // Hand up to nMaxMessages queued messages to OnMessage, on the calling thread.
+        // With bWait, sleep until there is at least one instead of returning straight
+        // away, so a client with nothing to do uses no CPU. Returns the number of
+        // messages handled.
+        size_t Update(size_t nMaxMessages = -1, bool bWait = false){
+            if (bWait)
+                m_qMessagesIn.wait();
+            return DispatchMessages(nMaxMessages);
+        }
+
+        // Like Update(nMaxMessages, true), but gives up waiting for the first message
+        // after timeout. Returns the number of messages handled.
+        template<typename Rep, typename Period>
+        size_t UpdateFor(size_t nMaxMessages, const std::chrono::duration<Rep, Period>& timeout){
+            if (!m_qMessagesIn.wait_for(timeout))
+                return 0;
+            return DispatchMessages(nMaxMessages);
+        }
+
+        // Block until a message from the server is available
         void Wait(){
             m_qMessagesIn.wait();
         }
 
+        // Block until a message from the server is available or the timeout expires.
+        // Returns true if a message is available.
+        template<typename Rep, typename Period>
+        bool WaitFor(const std::chrono::duration<Rep, Period>& timeout){
+            return m_qMessagesIn.wait_for(timeout);
+        }
+
+#ifdef ASIO_HAS_CO_AWAIT
+        // Run a coroutine on the client's io thread, starting the thread if need be.
+        // fn is a callable returning asio::awaitable<void>, typically a lambda using
+        // connect(), request() and send().
+        template<typename Func>
+        void Spawn(Func&& fn){
+            m_ticker.start();
+            if (!thrContext.joinable()){
+                // Keep the thread alive while the coroutine has nothing in flight
+                m_workGuard.emplace(m_context.get_executor());
+                thrContext = std::thread([this]() { m_context.run(); });
+            }
+            asio::co_spawn(m_context, std::forward<Func>(fn), asio::detached);
+        }
+
+        // COROUTINE - Connect to the server and complete validation. Throws on failure.
+        // Responses to request() are matched as they arrive, other messages go to
+        // Incoming(), unless the read mode was set to awaitable, in which case they are
+        // read with receive() instead and request() cannot be used.
+        asio::awaitable<void> connect(const std::string& host, const uint16_t port){
+            asio::ip::tcp::resolver resolver(m_context);
+            auto endpoints = co_await resolver.async_resolve(host, std::to_string(port), asio::use_awaitable);
+
+            m_connection = std::make_unique<connection<T>>(
+                connection<T>::owner::client,
+                m_context,
+                asio::ip::tcp::socket(asio::make_strand(m_context)), m_qMessagesIn);
+            m_connection->SetWriteLimits(m_nMaxWriteBytes, m_nMaxWriteBuffers);
+            m_connection->SetReadMode(m_nReadMode);
+            m_connection->SetSendLimits(m_sendLimits);
+            m_connection->SetRequestTable(&m_requests);
+            m_connection->SetClient(this);
+
+            co_await m_connection->connect(endpoints);
+        }
+
+        // COROUTINE - Send a message to the server
+        asio::awaitable<void> send(message<T> msg){
+            co_await m_connection->send(std::move(msg));
+        }
+
+        // COROUTINE - Read the next message from the server. Read mode awaitable only.
+        asio::awaitable<message<T>> receive(){
+            co_return co_await m_connection->receive();
+        }
+
+        // COROUTINE - Send a request and wait for its response. Several coroutines may
+        // have requests in flight at once. Throws request_error if no response arrives
+        // within timeout.
+        asio::awaitable<message<T>> request(message<T> msg, std::chrono::milliseconds timeout = std::chrono::seconds(5)){
+            auto pRequest = std::make_shared<pending_request<T>>(m_context);
+            ArmRequest(pRequest, msg, timeout);
+
+            co_await m_connection->send(std::move(msg));
+
+            // The response, or the deadline, may already have come while sending
+            if (!pRequest->bFinished){
+                asio::error_code ec;
+                co_await pRequest->wake.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+            }
+
+            if (pRequest->reply)
+                co_return std::move(*pRequest->reply);
+            throw request_error(pRequest->bCancelled ? "request cancelled" : "request timed out");
+        }
+#endif
+
+    protected:
+        // Called on the io thread once the connection is ready, when the client has
+        // answered the server's validation puzzle. Messages can be sent before that,
+        // they are held back until then.
+        virtual void OnConnect(){
+
+        }
+
+        // Called on the io thread when the connection to the server closes, or on the
+        // thread calling Disconnect(). Only after OnConnect. A derived client should
+        // call Disconnect() in its own destructor if it relies on this.
+        virtual void OnDisconnect(){
+
+        }
+
+        // Called by Update() for each message from the server
+        virtual void OnMessage(message<T>& msg){
+
+        }
+
+    protected:
+        // Track a request and start its deadline, the wheel hands an expired request
+        // back to the io thread to fail it
+        void ArmRequest(const std::shared_ptr<pending_request<T>>& pRequest, message<T>& msg, std::chrono::milliseconds timeout){
+            uint32_t nID = m_requests.add(pRequest);
+            msg.header.correlation = nID;
+            pRequest->deadline.bind(m_pWheel, [this, nID](){
+                asio::post(m_context, [this, nID](){ m_requests.expire(nID); });
+            });
+            pRequest->deadline.arm(timeout);
+        }
+
     protected:
         // asio context handles the data transfer
         asio::io_context m_context;
@@ -90,8 +306,112 @@ class client_interface{
         asio::ip::tcp::socket m_socket;
         // The client has a single instance of a "connection" object, which handles data transfer
         std::unique_ptr<connection<T>> m_connection;
+
+        // Request deadlines, on a wheel ticked by the io thread
+        std::shared_ptr<timer_wheel> m_pWheel;
+        wheel_ticker m_ticker;
+    
+        // Write coalescing limits handed to the connection
+        size_t m_nMaxWriteBytes = 64 * 1024;
+        size_t m_nMaxWriteBuffers = 64;
+
+        // Read mode handed to the connection
+        typename connection<T>::read_mode m_nReadMode = connection<T>::read_mode::framed;
+
+        // Keeps the io thread running for coroutines started with Spawn()
+        std::optional<asio::executor_work_guard<asio::io_context::executor_type>> m_workGuard;
+
+        // Outgoing queue bounds handed to the connection
+        typename connection<T>::send_limits m_sendLimits;
+
+        // Requests waiting for their response
+        request_table<T> m_requests;
     
+    private:
+        friend class connection<T>;
+
+        // Called by the connection, on the io thread
+        void ConnectionReady(){
+            m_nReconnectAttempts = 0;
+            m_bConnected = true;
+            OnConnect();
+        }
+
+        // Called by the connection on every failure, only the first one after
+        // ConnectionReady() counts
+        void ConnectionClosed(){
+            if (m_bConnected.exchange(false))
+                OnDisconnect();
+
+            if (m_reconnect.bEnabled && !m_bDisconnecting)
+                ScheduleReconnect();
+        }
+
+        // Messages are accepted while connected, and while waiting to reconnect
+        bool CanSend(){
+            return m_connection && (m_reconnect.bEnabled || m_connection->IsConnected());
+        }
+
+        // ASYNC - Connect again after a jittered, exponentially growing delay. Runs on
+        // the io thread, a failure may be reported several times but waits only once.
+        void ScheduleReconnect(){
+            if (m_bReconnectPending)
+                return;
+            m_bReconnectPending = true;
+
+            // Spread the clients of a restarted server out, rather than have them all
+            // come back in step
+            auto nDelay = std::min(m_reconnect.nMaxDelay, m_reconnect.nInitialDelay * (int64_t(1) << std::min<size_t>(m_nReconnectAttempts, 20)));
+            std::uniform_int_distribution<int64_t> jitter(nDelay.count() / 2, nDelay.count());
+            m_nReconnectAttempts++;
+
+            m_timerReconnect.expires_after(std::chrono::milliseconds(jitter(m_rng)));
+            m_timerReconnect.async_wait(asio::bind_executor(m_connection->GetExecutor(),
+                [this](std::error_code ec){
+                    m_bReconnectPending = false;
+                    if (ec || m_bDisconnecting)
+                        return;
+
+                    NET_LOG_INFO("Reconnecting, attempt " << m_nReconnectAttempts);
+                    m_connection->ConnectToServer(m_endpoints);
+                }));
+        }
+
+        // Hand up to nMaxMessages queued messages to OnMessage, a batch at a time
+        size_t DispatchMessages(size_t nMaxMessages){
+            size_t nMessageCount = 0;
+
+            // Each batch costs a single synchronisation with the io thread
+            while (nMessageCount < nMaxMessages){
+                if (m_qMessagesIn.drain(m_deqUpdateBatch, nMaxMessages - nMessageCount) == 0)
+                    break;
+
+                for (auto& msg : m_deqUpdateBatch)
+                    OnMessage(msg.msg);
+
+                nMessageCount += m_deqUpdateBatch.size();
+                m_deqUpdateBatch.clear();
+            }
+            return nMessageCount;
+        }
+
     private:
         // This is the thread safe queue of incoming messages from server
-        tsqueue<owned_message<T>> m_qMessagesIn;
+        incoming_queue<T> m_qMessagesIn;
+
+        // Batch of messages being dispatched by Update(), kept to reuse its memory
+        std::deque<owned_message<T>> m_deqUpdateBatch;
+
+        // Between the connection becoming ready and closing
+        std::atomic<bool> m_bConnected{ false };
+
+        // Reconnecting. The endpoints resolved by Connect() are reused, the rest is
+        // only touched on the io thread, except m_bDisconnecting.
+        reconnect_policy m_reconnect;
+        asio::ip::tcp::resolver::results_type m_endpoints;
+        asio::steady_timer m_timerReconnect;
+        std::minstd_rand m_rng;
+        size_t m_nReconnectAttempts = 0;
+        bool m_bReconnectPending = false;
+        std::atomic<bool> m_bDisconnecting{ false };
 };
\ No newline at end of file
@@ -10,6 +10,11 @@
 #include <algorithm>
 #include <chrono>
 #include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <array>
+#include <atomic>
+#include <condition_variable>
 
 #define ASIO_STANDALONE
 #include "asio.hpp"
@@ -2,11 +2,30 @@
 
 #include "net_common.h"
 #include "net_tsqueue.h"
+#include "net_mpscqueue.h"
 #include "net_message.h"
+#include "net_metrics.h"
+#include "net_log.h"
+#include "net_request.h"
+#include "net_timer_wheel.h"
+
+// Queue that connections deliver incoming messages into. Defining NET_MPSC_INCOMING
+// swaps the locked tsqueue for the lock-free mpsc_queue, which is worth it once
+// several threads produce into the same queue.
+#ifdef NET_MPSC_INCOMING
+template<typename T>
+using incoming_queue = mpsc_queue<owned_message<T>>;
+#else
+template<typename T>
+using incoming_queue = tsqueue<owned_message<T>>;
+#endif
 
 template<typename T>
 class server_interface;
 
+template<typename T>
+class client_interface;
+
 template<typename T>
     class connection : public std::enable_shared_from_this<connection<T>>{
     public:
@@ -17,13 +36,67 @@ template<typename T>
             client
         };
 
+        // How incoming bytes are turned into messages. "framed" issues one exact-size
+        // read for every header and every body. "buffered" reads whatever the socket
+        // has into a per-connection buffer and parses every complete message out of it
+        // before reading again, which suits streams of many small messages.
+        // "awaitable" reads nothing by itself: a coroutine pulls each message with
+        // co_await receive() and handles it right there on the io thread.
+        enum class read_mode{
+            framed,
+            buffered,
+            awaitable
+        };
+
+        // What happens to a message that would take the outgoing queue over one of its limits
+        enum class overflow_policy{
+            // Make room by discarding the oldest queued messages
+            drop_oldest,
+            // Discard the message being sent
+            drop_newest,
+            // Discard the queued messages with the same id, which the new message
+            // supersedes. If there are none, discard the new message instead.
+            coalesce,
+            // Give up on the remote and close the connection
+            disconnect
+        };
+
+        // Bounds on the outgoing queue, 0 means unlimited. Sizes are bytes on the wire,
+        // header included, and a broadcast frame counts in full for every recipient.
+        // Messages already handed to the socket are never dropped, but they do count.
+        struct send_limits{
+            size_t nMaxBytes = 0;
+            overflow_policy nBytesPolicy = overflow_policy::drop_oldest;
+
+            size_t nMaxMessages = 0;
+            overflow_policy nMessagesPolicy = overflow_policy::drop_oldest;
+
+            // The server is told once the queued bytes reach nHighWatermark, and again
+            // once they have fallen back to nLowWatermark. 0 disables the notifications.
+            size_t nHighWatermark = 0;
+            size_t nLowWatermark = 0;
+        };
+
+        // Deadlines of a server connection, kept on the shard's timer wheel. 0 disables each.
+        struct timeouts{
+            // From accepting the socket to the client passing validation
+            std::chrono::milliseconds handshake{ 0 };
+            // Close the connection once nothing has been received for this long
+            std::chrono::milliseconds idle{ 0 };
+            // Send the heartbeat message once nothing has been sent for this long,
+            // so that a quiet client still hears from the server
+            std::chrono::milliseconds heartbeat{ 0 };
+        };
+
     public:
         // Constructor: Specify Owner, connect to context, transfer the socket
         //				Provide reference to incoming message queue
-        connection(owner parent, asio::io_context& asioContext, asio::ip::tcp::socket socket, tsqueue<owned_message<T>>& qIn)
+        connection(owner parent, asio::io_context& asioContext, asio::ip::tcp::socket socket, incoming_queue<T>& qIn)
             : m_asioContext(asioContext), m_socket(std::move(socket)), m_qMessagesIn(qIn){
             
             m_nOwnerType = parent;
+            m_nCreatedAt = connection_metrics::Now();
+            m_bOpen = m_socket.is_open();
 
             // Construct validation check data
             if (m_nOwnerType == owner::server){
@@ -39,6 +112,9 @@ template<typename T>
                 // Connection is Client -> Server, so we have nothing to define, 
                 m_nHandshakeIn = 0;
                 m_nHandshakeOut = 0;
+
+                // Messages sent before the handshake wait for the answer to the puzzle
+                m_bHandshakePending = true;
             }
         }
 
@@ -54,20 +130,43 @@ template<typename T>
         void ConnectToClient(server_interface<T>* server, uint32_t uid = 0){
             if (m_nOwnerType == owner::server){
                 if (m_socket.is_open()){
-                    id = uid;                   
-                    // A client has attempted to connect to the server, but we wish
-                    // the client to first validate itself. Write the data for validation
-                    WriteValidation();
-
-                    // Wait asynchronously for the validation data sent back from the client
-                    ReadValidation(server);
+                    id = uid;
+                    m_pServer = server;
+
+                    // A client that never answers the validation puzzle is dropped
+                    if (m_timeouts.handshake.count() > 0)
+                        m_deadline.arm(m_timeouts.handshake);
+
+                    // Everything touching the socket runs on the connection's strand,
+                    // including the start of the handshake
+                    asio::post(m_socket.get_executor(), [this, server](){
+                        // A client has attempted to connect to the server, but we wish
+                        // the client to first validate itself. Write the data for validation
+                        WriteValidation();
+
+                        // Wait asynchronously for the validation data sent back from the client
+                        ReadValidation(server);
+                    });
                 }
             }
         }
 
+        // Also used to connect again after the connection closed, on the strand, once the
+        // handlers of the previous socket have run. Messages still queued go out once
+        // the handshake has been answered, starting with any the last write did not finish.
         void ConnectToServer(const asio::ip::tcp::resolver::results_type& endpoints){
             // Only clients can connect to servers
             if (m_nOwnerType == owner::client){
+                // Forget whatever the previous socket was in the middle of
+                m_nMessagesInFlight = 0;
+                m_nBytesInFlight = 0;
+                m_bHandshakePending = true;
+                m_bWriteHandshake = false;
+                m_nReadStart = m_nReadEnd = 0;
+                m_msgTemporaryIn.header = {};
+                m_msgTemporaryIn.body.clear();
+                m_bOpen = true;
+
                 // Request asio attempts to connect to an endpoint
                 asio::async_connect(m_socket, endpoints,
                     [this](std::error_code ec, asio::ip::tcp::endpoint endpoint){
@@ -76,6 +175,12 @@ template<typename T>
                             // so wait for that and respond
                             ReadValidation();
                         }
+                        else{
+                            // No endpoint took the connection, leave the socket closed
+                            // so IsConnected() says so
+                            NET_LOG_INFO("Connect Fail: " << ec.message());
+                            Close();
+                        }
                     });
             }
         }
@@ -83,99 +188,483 @@ template<typename T>
 
         void Disconnect(){
             if (IsConnected())
-                asio::post(m_asioContext, [this]() { m_socket.close(); });
+                asio::post(m_socket.get_executor(), [this]() { Close(); });
         }
 
+        // Safe to call from any thread, unlike asking the socket, which the strand
+        // may be closing or reopening
         bool IsConnected() const{
-            return m_socket.is_open();
+            return m_bOpen.load(std::memory_order_relaxed);
         }
 
         // Prime the connection to wait for incoming messages
         void StartListening(){
-            
+            if (m_nReadMode == read_mode::buffered)
+                ReadSome();
+            else if (m_nReadMode == read_mode::framed)
+                ReadHeader();
+        }
+
+        // Executor every handler of this connection runs on (its strand). Coroutines
+        // using receive() and send() should be spawned on it.
+        auto GetExecutor(){
+            return m_socket.get_executor();
+        }
+
+        // Select how incoming messages are read, must be called before the
+        // connection starts listening
+        void SetReadMode(read_mode mode){
+            m_nReadMode = mode;
+        }
+
+        // Limit how much of the outgoing queue is gathered into a single write. asio
+        // issues at most 64 buffers per writev call, so larger values only help when
+        // the kernel accepts the whole sequence in one go.
+        void SetWriteLimits(size_t nMaxBytes, size_t nMaxBuffers){
+            m_nMaxWriteBytes = std::max<size_t>(nMaxBytes, 1);
+            m_nMaxWriteBuffers = std::max<size_t>(nMaxBuffers, 2);
+        }
+
+        // Bound the outgoing queue, must be called before the connection starts sending
+        void SetSendLimits(const send_limits& limits){
+            m_sendLimits = limits;
+        }
+
+        // Server side: enforce deadlines using the shard's timer wheel. pHeartbeat is the
+        // message sent when the heartbeat interval passes without anything else being
+        // sent. Must be called before ConnectToClient().
+        void SetTimeouts(const timeouts& limits, std::shared_ptr<timer_wheel> pWheel, std::shared_ptr<const message<T>> pHeartbeat){
+            m_timeouts = limits;
+            m_pHeartbeat = std::move(pHeartbeat);
+            if (m_timeouts.heartbeat.count() > 0 && !m_pHeartbeat)
+                m_timeouts.heartbeat = std::chrono::milliseconds(0);
+
+            // The wheel only gets to post the work onto the strand. A connection being
+            // destroyed can no longer be locked, and its timer is cancelled with it. The
+            // reference is moved on, never released here, as the wheel is locked.
+            m_deadline.bind(std::move(pWheel), [this](){
+                if (auto self = this->weak_from_this().lock())
+                    asio::post(m_socket.get_executor(), [self = std::move(self)](){ self->OnDeadline(); });
+            });
+        }
+
+        // Client side: keep queueing messages while the connection is closed, up to
+        // nMaxBytes, to send them once it has connected again. Beyond that the oldest
+        // are discarded.
+        void SetHoldWhileClosed(size_t nMaxBytes){
+            m_bHoldWhileClosed = true;
+            m_nMaxHeldBytes = nMaxBytes;
+        }
+
+        // Client side: tell the client when the connection is ready for use and when it closes
+        void SetClient(client_interface<T>* pClient){
+            m_pClient = pClient;
+        }
+
+        // Hand responses to the requests in this table to their requester instead of the
+        // incoming queue. Must be called before the connection starts listening.
+        void SetRequestTable(request_table<T>* pRequests){
+            m_pRequests = pRequests;
+        }
+
+        // Bytes waiting in the outgoing queue, including the write in flight
+        size_t GetQueuedBytes() const{
+            return m_nQueuedBytes.load(std::memory_order_relaxed);
+        }
+
+        // Number of messages discarded by the send limits so far
+        uint64_t GetDroppedMessages() const{
+            return m_nDroppedMessages.load(std::memory_order_relaxed);
+        }
+
+        // True between the high and the low watermark notifications
+        bool IsAboveHighWatermark() const{
+            return m_bAboveHighWatermark.load(std::memory_order_relaxed);
+        }
+
+        // Counters for this connection, updated as it runs
+        connection_metrics& Metrics(){
+            return m_metrics;
+        }
+
+        // Point in time copy of this connection's metrics, safe from any thread
+        connection_metrics_snapshot GetMetrics() const{
+            connection_metrics_snapshot s;
+            s.nID = id;
+            m_metrics.Fill(s);
+            s.nQueuedBytes = GetQueuedBytes();
+            s.nDropped = GetDroppedMessages();
+            return s;
         }
 
     public:
         // ASYNC - Send a message, connections are one-to-one so no need to specifiy
         // the target, for a client, the target is the server and vice versa
         void Send(const message<T>& msg){
-            asio::post(m_asioContext,
-                [this, msg](){
-                    // If the queue has a message in it, then we must 
-                    // assume that it is in the process of asynchronously being written.
-                    // Either way add the message to the queue to be output. If no messages
-                    // were available to be written, then start the process of writing the
-                    // message at the front of the queue.
-                    bool bWritingMessage = !m_qMessagesOut.empty();
-                    m_qMessagesOut.push_back(msg);
-                    if (!bWritingMessage){
-                        WriteHeader();
-                    }
+            // Take the one unavoidable copy here, from then on the message is moved
+            Send(message<T>(msg));
+        }
+
+        // ASYNC - Send a message the caller no longer needs. The body is moved all the
+        // way into the outgoing queue and never copied.
+        void Send(message<T>&& msg){
+            // The outgoing queue is only ever touched on the connection's strand
+            asio::post(m_socket.get_executor(),
+                [this, msg = std::move(msg)]() mutable{
+                    QueueMessage({ std::move(msg), nullptr });
                 });
         }
 
+        // ASYNC - Send a message shared with other connections. Only the pointer is
+        // queued, the message itself is written straight from the shared copy.
+        void Send(std::shared_ptr<const message<T>> msg){
+            asio::post(m_socket.get_executor(),
+                [this, msg = std::move(msg)]() mutable{
+                    QueueMessage({ message<T>(), std::move(msg) });
+                });
+        }
+
+
+
+#ifdef ASIO_HAS_CO_AWAIT
+    public:
+        // COROUTINE - Read the next message straight off the socket, for connections in
+        // read_mode::awaitable. Only one receive() may be outstanding at a time. Throws
+        // if the connection fails, after closing the socket.
+        asio::awaitable<message<T>> receive(){
+            message<T> msg;
+            try{
+                co_await asio::async_read(m_socket, asio::buffer(&msg.header, sizeof(message_header<T>)), asio::use_awaitable);
+                if (msg.header.size > 0){
+                    msg.body.resize(msg.header.size);
+                    co_await asio::async_read(m_socket, asio::buffer(msg.body.data(), msg.body.size()), asio::use_awaitable);
+                }
+            }
+            catch (...){
+                NET_LOG_INFO("[" << id << "] Receive Fail.");
+                Close();
+                throw;
+            }
+
+            MarkReceived();
+            m_metrics.MessageIn(WireSize(msg));
+            co_return msg;
+        }
+
+        // COROUTINE - Send a message. Completes once the message is on the outgoing queue,
+        // so it is written in order with everything else sent on this connection and is
+        // subject to the same send limits.
+        asio::awaitable<void> send(message<T> msg){
+            co_await asio::dispatch(m_socket.get_executor(), asio::use_awaitable);
+            QueueMessage({ std::move(msg), nullptr });
+        }
 
+        // COROUTINE - Client side: connect to the server and answer its validation.
+        // The connection is ready to send once this completes. Throws on failure.
+        asio::awaitable<void> connect(const asio::ip::tcp::resolver::results_type& endpoints){
+            if (m_nOwnerType != owner::client)
+                co_return;
+
+            m_bOpen = true;
+            try{
+                co_await asio::async_connect(m_socket, endpoints, asio::use_awaitable);
+
+                // Solve the server's puzzle and send the result back
+                co_await asio::async_read(m_socket, asio::buffer(&m_nHandshakeIn, sizeof(uint64_t)), asio::use_awaitable);
+                m_nHandshakeOut = scramble(m_nHandshakeIn);
+                co_await asio::async_write(m_socket, asio::buffer(&m_nHandshakeOut, sizeof(uint64_t)), asio::use_awaitable);
+            }
+            catch (...){
+                NET_LOG_INFO("Connect Fail.");
+                Close();
+                throw;
+            }
+
+            // Flush whatever was sent while connecting
+            co_await asio::dispatch(m_socket.get_executor(), asio::use_awaitable);
+            m_bHandshakePending = false;
+            if (!m_qMessagesOut.empty())
+                WriteMessages();
+            if (m_pClient)
+                m_pClient->ConnectionReady();
+
+            // Unless reads are awaited, messages now arrive in the incoming queue
+            StartListening();
+        }
+#endif
 
     private:
-        // ASYNC - Prime context to write a message header
-        void WriteHeader(){
-            // Queue has a message to send, allocate a transmission buffer to hold
-            // the message, and issue the work
-            asio::async_write(m_socket, asio::buffer(&m_qMessagesOut.front().header, sizeof(message_header<T>)),
+        // Size of a message on the wire
+        static size_t WireSize(const message<T>& msg){
+            return sizeof(message_header<T>) + msg.body.size();
+        }
+
+        // Note that the remote is alive, for the idle timeout
+        void MarkReceived(){
+            if (m_timeouts.idle.count() > 0)
+                m_tLastReceive = std::chrono::steady_clock::now();
+        }
+
+        // Runs on the strand when the connection's deadline passes: drop a client that
+        // missed the handshake deadline or went idle, send a heartbeat if one is due,
+        // and arm the timer for whatever is due next
+        void OnDeadline(){
+            if (!m_socket.is_open()){
+                // Closed at least a tick ago, so the handlers it aborted have run by now
+                if (m_bRelease && m_pServer){
+                    m_bRelease = false;
+                    m_pServer->ReleaseClient(this->shared_from_this());
+                }
+                return;
+            }
+
+            auto tNow = std::chrono::steady_clock::now();
+            if (!m_bValidHandshake){
+                NET_LOG_WARN("[" << id << "] Handshake Timeout.");
+                CloseAndRelease();
+                return;
+            }
+
+            if (m_timeouts.idle.count() > 0 && tNow - m_tLastReceive >= m_timeouts.idle){
+                NET_LOG_WARN("[" << id << "] Idle Timeout.");
+                CloseAndRelease();
+                return;
+            }
+
+            if (m_timeouts.heartbeat.count() > 0 && tNow - m_tLastSend >= m_timeouts.heartbeat){
+                // Anything already queued is about to prove the connection alive anyway
+                if (m_qMessagesOut.empty())
+                    QueueMessage({ message<T>(), m_pHeartbeat });
+                m_tLastSend = tNow;
+            }
+
+            ArmDeadline(tNow);
+        }
+
+        // Arm the timer for the next idle or heartbeat deadline, whichever is sooner
+        void ArmDeadline(std::chrono::steady_clock::time_point tNow){
+            auto tNext = std::chrono::steady_clock::time_point::max();
+            if (m_timeouts.idle.count() > 0)
+                tNext = std::min(tNext, m_tLastReceive + m_timeouts.idle);
+            if (m_timeouts.heartbeat.count() > 0)
+                tNext = std::min(tNext, m_tLastSend + m_timeouts.heartbeat);
+
+            if (tNext != std::chrono::steady_clock::time_point::max())
+                m_deadline.arm(tNext - tNow);
+            else
+                m_deadline.cancel();
+        }
+
+        // Close the socket, every failure ends up here. A client is told its connection
+        // has gone, the server notices when it next sends to it.
+        void Close(){
+            m_socket.close();
+            m_bOpen = false;
+            if (m_pClient){
+                // Nothing more is written until the handshake of a new connection
+                m_bHandshakePending = true;
+                m_pClient->ConnectionClosed();
+            }
+        }
+
+        // Close the socket and take the connection out of the server a tick later,
+        // rather than waiting for the next send to the client to notice it is gone, so a
+        // dead client gives its file descriptor and memory back promptly. Handlers the
+        // close aborts still point at this connection, the tick gives them time to run.
+        void CloseAndRelease(){
+            m_socket.close();
+            m_bOpen = false;
+            m_bRelease = true;
+            m_deadline.arm(m_deadline.tick());
+        }
+
+        // Runs on the strand. Applies the send limits, then queues the message
+        void QueueMessage(outgoing_message<T>&& out){
+            // A closed connection never writes again, don't let its queue grow, unless
+            // the client is going to reconnect
+            if (!m_socket.is_open() && !m_bHoldWhileClosed)
+                return;
+
+            // Make room for the message as the policy of each exceeded limit says.
+            // Only messages behind the ones being written may be discarded.
+            size_t nBytes = WireSize(out.get());
+            overflow_policy nPolicy;
+            while (Overflows(nBytes, nPolicy)){
+                auto itFirstQueued = m_qMessagesOut.begin() + m_nMessagesInFlight;
+
+                if (nPolicy == overflow_policy::drop_oldest && itFirstQueued != m_qMessagesOut.end()){
+                    EraseQueued(itFirstQueued);
+                    continue;
+                }
+
+                if (nPolicy == overflow_policy::coalesce){
+                    auto it = std::find_if(itFirstQueued, m_qMessagesOut.end(),
+                        [&](const outgoing_message<T>& queued){ return queued.get().header.id == out.get().header.id; });
+                    if (it != m_qMessagesOut.end()){
+                        EraseQueued(it);
+                        continue;
+                    }
+                }
+
+                if (nPolicy == overflow_policy::disconnect){
+                    NET_LOG_WARN("[" << id << "] Send Queue Overflow.");
+                    while (m_qMessagesOut.size() > m_nMessagesInFlight)
+                        EraseQueued(m_qMessagesOut.begin() + m_nMessagesInFlight);
+                    Close();
+                }
+
+                // Nothing (more) can be discarded to make room, so the new message goes
+                m_nDroppedMessages.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+
+            // If the queue has a message in it, then we must 
+            // assume that it is in the process of asynchronously being written.
+            // Either way add the message to the queue to be output. If no messages
+            // were available to be written, then start the process of writing the
+            // message at the front of the queue.
+            // A client still in its handshake holds everything back, the answer to the
+            // validation puzzle has to go first.
+            bool bWritingMessage = !m_qMessagesOut.empty() || m_bHandshakePending;
+            m_qMessagesOut.push_back(std::move(out));
+            m_nQueuedBytes.fetch_add(nBytes, std::memory_order_relaxed);
+            m_metrics.QueueDepth(m_qMessagesOut.size());
+            UpdateWatermarks();
+
+            if (!bWritingMessage){
+                WriteMessages();
+            }
+        }
+
+        // Would queueing nBytes more exceed a limit? If so nPolicy receives its policy
+        bool Overflows(size_t nBytes, overflow_policy& nPolicy) const{
+            if (m_bHoldWhileClosed && m_nMaxHeldBytes > 0 && !m_socket.is_open() && GetQueuedBytes() + nBytes > m_nMaxHeldBytes){
+                nPolicy = overflow_policy::drop_oldest;
+                return true;
+            }
+            if (m_sendLimits.nMaxBytes > 0 && GetQueuedBytes() + nBytes > m_sendLimits.nMaxBytes){
+                nPolicy = m_sendLimits.nBytesPolicy;
+                return true;
+            }
+            if (m_sendLimits.nMaxMessages > 0 && m_qMessagesOut.size() >= m_sendLimits.nMaxMessages){
+                nPolicy = m_sendLimits.nMessagesPolicy;
+                return true;
+            }
+            return false;
+        }
+
+        // Discard a queued message that is not part of the write in flight. deque::erase
+        // may shift the elements in front of the hole instead, and the write in flight
+        // points into those, so only ever move the ones behind it.
+        void EraseQueued(typename std::deque<outgoing_message<T>>::iterator it){
+            m_nQueuedBytes.fetch_sub(WireSize(it->get()), std::memory_order_relaxed);
+            std::move(it + 1, m_qMessagesOut.end(), it);
+            m_qMessagesOut.pop_back();
+            m_nDroppedMessages.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // Tell the server when the queued bytes cross the watermarks
+        void UpdateWatermarks(){
+            if (m_sendLimits.nHighWatermark == 0)
+                return;
+
+            size_t nQueued = GetQueuedBytes();
+            if (!IsAboveHighWatermark() && nQueued >= m_sendLimits.nHighWatermark){
+                m_bAboveHighWatermark.store(true, std::memory_order_relaxed);
+                if (m_pServer)
+                    m_pServer->OnClientSendHighWatermark(this->shared_from_this());
+            }
+            else if (IsAboveHighWatermark() && nQueued <= m_sendLimits.nLowWatermark){
+                m_bAboveHighWatermark.store(false, std::memory_order_relaxed);
+                if (m_pServer)
+                    m_pServer->OnClientSendLowWatermark(this->shared_from_this());
+            }
+        }
+
+        // Lightweight ConstBufferSequence over the write buffers owned by the connection
+        struct buffer_sequence_view{
+            using value_type = asio::const_buffer;
+            using const_iterator = const asio::const_buffer*;
+            const asio::const_buffer* pBegin;
+            const asio::const_buffer* pEnd;
+            const_iterator begin() const { return pBegin; }
+            const_iterator end() const { return pEnd; }
+        };
+
+        // ASYNC - Prime context to write every queued message in one go
+        void WriteMessages(){
+            // Gather as many queued messages as the limits allow into a single buffer
+            // sequence, header and body of each one back to back. asio then flushes the
+            // whole backlog with one vectored write (writev) instead of one write per message.
+            // At least one message is always taken, even if it is larger than the byte limit.
+            m_vWriteBuffers.clear();
+            m_nMessagesInFlight = 0;
+            size_t nBytes = 0;
+
+            // A client's answer to the validation puzzle leads the messages it queued
+            // while waiting for the puzzle, so they reach the server in the same segment
+            if (m_bWriteHandshake)
+                m_vWriteBuffers.push_back(asio::buffer(&m_nHandshakeOut, sizeof(uint64_t)));
+
+            for (const auto& queued : m_qMessagesOut){
+                const message<T>& msg = queued.get();
+                size_t nMsgBytes = WireSize(msg);
+                size_t nMsgBuffers = msg.body.empty() ? 1 : 2;
+
+                if (m_nMessagesInFlight > 0 &&
+                    (nBytes + nMsgBytes > m_nMaxWriteBytes || m_vWriteBuffers.size() + nMsgBuffers > m_nMaxWriteBuffers))
+                    break;
+
+                m_vWriteBuffers.push_back(asio::buffer(&msg.header, sizeof(message_header<T>)));
+                if (!msg.body.empty())
+                    m_vWriteBuffers.push_back(asio::buffer(msg.body.data(), msg.body.size()));
+
+                nBytes += nMsgBytes;
+                m_nMessagesInFlight++;
+            }
+            m_nBytesInFlight = nBytes;
+
+            // Hand asio a view of the buffer vector rather than the vector itself,
+            // otherwise the vector is copied into the write operation every time
+            asio::async_write(m_socket, buffer_sequence_view{ m_vWriteBuffers.data(), m_vWriteBuffers.data() + m_vWriteBuffers.size() },
                 [this](std::error_code ec, std::size_t length){
                     // asio has now sent the bytes - if there was a problem
                     // an error would be available
                     if (!ec){
-                        // no error, so check if the message header just sent also
-                        // has a message body
-                        if (m_qMessagesOut.front().body.size() > 0){
-                            // issue the task to write the body bytes
-                            WriteBody();
+                        // The client has answered the puzzle, so the server will now
+                        // send it messages, and it may send the server more
+                        if (m_bWriteHandshake){
+                            m_bWriteHandshake = false;
+                            m_bHandshakePending = false;
+                            if (m_pClient)
+                                m_pClient->ConnectionReady();
+                            StartListening();
                         }
-                        else{
-                            // no body, so we are done with this message. Remove it from 
-                            // the outgoing message queue
-                            m_qMessagesOut.pop_front();
-
-                            // If the queue is not empty, there are more messages to send, so
-                            // make this happen by issuing the task to send the next header.
-                            if (!m_qMessagesOut.empty()){
-                                WriteHeader();
-                            }
+
+                        // Sending was successful, so we are done with every message that
+                        // was part of this write, remove them all from the queue
+                        m_qMessagesOut.erase(m_qMessagesOut.begin(), m_qMessagesOut.begin() + m_nMessagesInFlight);
+                        m_metrics.MessagesOut(m_nMessagesInFlight, m_nBytesInFlight);
+                        m_metrics.QueueDepth(m_qMessagesOut.size());
+                        m_nMessagesInFlight = 0;
+                        m_nQueuedBytes.fetch_sub(m_nBytesInFlight, std::memory_order_relaxed);
+                        m_nBytesInFlight = 0;
+                        if (m_timeouts.heartbeat.count() > 0)
+                            m_tLastSend = std::chrono::steady_clock::now();
+                        UpdateWatermarks();
+
+                        // If messages were queued while writing, issue the task to 
+                        // send the new backlog.
+                        if (!m_qMessagesOut.empty() && !m_bHandshakePending){
+                            WriteMessages();
                         }
                     }
                     else{
-                        // asio failed to write the message, assume the connection has died by closing the
+                        // asio failed to write the messages, assume the connection has died by closing the
                         // socket. When a future attempt to write to this client fails due
                         // to the closed socket, it will be tidied up.
-                        std::cout << "[" << id << "] Write Header Fail.\n";
-                        m_socket.close();
-                    }
-                });
-        }
-
-        // ASYNC - Prime context to write a message body
-        void WriteBody(){
-            // If this function is called, a header has just been sent, and that header
-            // indicated a body existed for this message. Fill a transmission buffer
-            // with the body data, and send it
-            asio::async_write(m_socket, asio::buffer(m_qMessagesOut.front().body.data(), m_qMessagesOut.front().body.size()),
-                [this](std::error_code ec, std::size_t length){
-                    if (!ec){
-                        // Sending was successful, so we are done with the message
-                        // and remove it from the queue
-                        m_qMessagesOut.pop_front();
-
-                        // If the queue still has messages in it, then issue the task to 
-                        // send the next messages' header.
-                        if (!m_qMessagesOut.empty()){
-                            WriteHeader();
-                        }
-                    }
-                    else{
-                        // Sending failed, see WriteHeader() equivalent for description
-                        std::cout << "[" << id << "] Write Body Fail.\n";
-                        m_socket.close();
+                        NET_LOG_INFO("[" << id << "] Write Messages Fail.");
+                        Close();
                     }
                 });
         }
@@ -188,6 +677,8 @@ template<typename T>
             asio::async_read(m_socket, asio::buffer(&m_msgTemporaryIn.header, sizeof(message_header<T>)),
                 [this](std::error_code ec, std::size_t length){						
                     if (!ec){
+                        MarkReceived();
+
                         // A complete message header has been read, check if this message
                         // has a body to follow.
                         if (m_msgTemporaryIn.header.size > 0){
@@ -198,15 +689,16 @@ template<typename T>
                         }
                         else{
                             // it doesn't, so add this bodyless message to the connections
-                            // incoming message queue
+                            // incoming message queue, and wait for the next one
                             AddToIncomingMessageQueue();
+                            ReadHeader();
                         }
                     }
                     else{
                         // Reading form the client went wrong, most likely a disconnect
                         // has occurred. Close the socket and let the system tidy it up later.
-                        std::cout << "[" << id << "] Read Header Fail.\n";
-                        m_socket.close();
+                        NET_LOG_INFO("[" << id << "] Read Header Fail.");
+                        Close();
                     }
                 });
         }
@@ -219,18 +711,80 @@ template<typename T>
             asio::async_read(m_socket, asio::buffer(m_msgTemporaryIn.body.data(), m_msgTemporaryIn.body.size()),
                 [this](std::error_code ec, std::size_t length){						
                     if (!ec){
+                        MarkReceived();
+
                         // the message is now complete, so add
                         // the whole message to incoming queue
                         AddToIncomingMessageQueue();
+                        ReadHeader();
                     }
                     else{
                         // Same error logic follows                        
-                        std::cout << "[" << id << "] Read Body Fail.\n";
-                        m_socket.close();
+                        NET_LOG_INFO("[" << id << "] Read Body Fail.");
+                        Close();
                     }
                 });
         }
 
+        // ASYNC - Prime context to read whatever the socket has into the read buffer
+        void ReadSome(){
+            // Anything left over from the last read is the start of an incomplete
+            // message, move it to the front so the free space is contiguous
+            if (m_nReadStart > 0){
+                std::memmove(m_vReadBuffer.data(), m_vReadBuffer.data() + m_nReadStart, m_nReadEnd - m_nReadStart);
+                m_nReadEnd -= m_nReadStart;
+                m_nReadStart = 0;
+            }
+
+            // The buffer must always have room left to read into
+            if (m_vReadBuffer.size() < nReadBufferSize)
+                m_vReadBuffer.resize(nReadBufferSize);
+            else if (m_nReadEnd == m_vReadBuffer.size())
+                m_vReadBuffer.resize(m_vReadBuffer.size() * 2);
+
+            m_socket.async_read_some(asio::buffer(m_vReadBuffer.data() + m_nReadEnd, m_vReadBuffer.size() - m_nReadEnd),
+                [this](std::error_code ec, std::size_t length){
+                    if (!ec){
+                        MarkReceived();
+
+                        // Parse every complete message that arrived, then go back for more
+                        m_nReadEnd += length;
+                        ParseReadBuffer();
+                        ReadSome();
+                    }
+                    else{
+                        // Same error logic as the framed reads
+                        NET_LOG_INFO("[" << id << "] Read Fail.");
+                        Close();
+                    }
+                });
+        }
+
+        // Extract all complete messages sitting in the read buffer
+        void ParseReadBuffer(){
+            while (m_nReadEnd - m_nReadStart >= sizeof(message_header<T>)){
+                const uint8_t* pFrame = m_vReadBuffer.data() + m_nReadStart;
+                std::memcpy(&m_msgTemporaryIn.header, pFrame, sizeof(message_header<T>));
+
+                size_t nFrameSize = sizeof(message_header<T>) + m_msgTemporaryIn.header.size;
+                if (m_nReadEnd - m_nReadStart < nFrameSize){
+                    // The body has not fully arrived yet. If it cannot fit in the buffer
+                    // at all, grow it now so the next read has somewhere to put it
+                    if (nFrameSize > m_vReadBuffer.size())
+                        m_vReadBuffer.resize(nFrameSize);
+                    break;
+                }
+
+                m_msgTemporaryIn.body.assign(pFrame + sizeof(message_header<T>), pFrame + nFrameSize);
+                AddToIncomingMessageQueue();
+                m_nReadStart += nFrameSize;
+            }
+
+            // Everything consumed, start filling from the beginning again
+            if (m_nReadStart == m_nReadEnd)
+                m_nReadStart = m_nReadEnd = 0;
+        }
+
         // "Encrypt" data
         uint64_t scramble(uint64_t nInput){
             uint64_t out = nInput ^ 0xDEADBEEFC0DECAFE;
@@ -238,19 +792,12 @@ template<typename T>
             return out ^ 0xC0DEFACE12345678;
         }
 
-        // ASYNC - Used by both client and server to write validation packet
+        // ASYNC - Used by the server to write the validation puzzle
         void WriteValidation(){
             asio::async_write(m_socket, asio::buffer(&m_nHandshakeOut, sizeof(uint64_t)),
                 [this](std::error_code ec, std::size_t length){
-                    if (!ec){
-                        // Validation data sent, clients should sit and wait
-                        // for a response (or a closure)
-                        if (m_nOwnerType == owner::client)
-                            ReadHeader();
-                    }
-                    else{
-                        m_socket.close();
-                    }
+                    if (ec)
+                        Close();
                 });
         }
 
@@ -264,30 +811,39 @@ template<typename T>
                             // Compare sent data to actual solution
                             if (m_nHandshakeIn == m_nHandshakeCheck){
                                 // Client has provided valid solution, so allow it to connect properly
-                                std::cout << "Client Validated" << std::endl;
+                                NET_LOG_INFO("[" << id << "] Client Validated");
+                                m_bValidHandshake = true;
+                                uint64_t nHandshakeNs = connection_metrics::Now() - m_nCreatedAt;
+                                m_metrics.Handshake(nHandshakeNs);
+                                server->RecordHandshake(nHandshakeNs);
                                 server->OnClientValidated(this->shared_from_this());
 
+                                // The handshake deadline gives way to the idle and heartbeat ones
+                                m_tLastReceive = m_tLastSend = std::chrono::steady_clock::now();
+                                ArmDeadline(m_tLastReceive);
+
                                 // Sit waiting to receive data now
-                                ReadHeader();
+                                StartListening();
                             }
                             else{
                                 // Client gave incorrect data, so disconnect
-                                std::cout << "Client Disconnected (Fail Validation)" << std::endl;
-                                m_socket.close();
+                                NET_LOG_WARN("[" << id << "] Client Disconnected (Fail Validation)");
+                                Close();
                             }
                         }
                         else{
                             // Connection is a client, so solve puzzle
                             m_nHandshakeOut = scramble(m_nHandshakeIn);
 
-                            // Write the result
-                            WriteValidation();
+                            // Write the result, together with anything sent so far
+                            m_bWriteHandshake = true;
+                            WriteMessages();
                         }
                     }
                     else{
                         // Some biggerfailure occured
-                        std::cout << "Client Disconnected (ReadValidation)" << std::endl;
-                        m_socket.close();
+                        NET_LOG_INFO("[" << id << "] Client Disconnected (ReadValidation)");
+                        Close();
                     }
                 });
         }
@@ -295,35 +851,77 @@ template<typename T>
         // Once a full message is received, add it to the incoming queue
         void AddToIncomingMessageQueue(){				
             // Shove it in queue, converting it to an "owned message", by initialising
-            // with the a shared pointer from this connection object
+            // with the a shared pointer from this connection object. The temporary message
+            // is moved, not copied, so its body goes to the queue as is.
+            m_metrics.MessageIn(WireSize(m_msgTemporaryIn));
+
+            // A response to a request is delivered straight to whoever is waiting for it
+            if (m_pRequests && m_pRequests->complete(m_msgTemporaryIn)){
+                m_msgTemporaryIn.header = {};
+                m_msgTemporaryIn.body.clear();
+                return;
+            }
+
             if(m_nOwnerType == owner::server)
-                m_qMessagesIn.push_back({ this->shared_from_this(), m_msgTemporaryIn });
+                m_qMessagesIn.emplace_back(owned_message<T>{ this->shared_from_this(), std::move(m_msgTemporaryIn), connection_metrics::Now() });
             else
-                m_qMessagesIn.push_back({ nullptr, m_msgTemporaryIn });
+                m_qMessagesIn.emplace_back(owned_message<T>{ nullptr, std::move(m_msgTemporaryIn), connection_metrics::Now() });
 
-            // Prime asio context to receive more messages. Message construction
-            // process repeats itself.
-            ReadHeader();
+            // Leave the temporary in a known empty state for the next message
+            m_msgTemporaryIn.header = {};
+            m_msgTemporaryIn.body.clear();
         }
 
     protected:
-        // Each connection has a unique socket to a remote 
+        // Each connection has a unique socket to a remote. Its executor is the
+        // connection's strand, so every completion handler for this connection runs
+        // in order, one at a time, whichever io thread picks it up.
         asio::ip::tcp::socket m_socket;
 
         // This context is shared with the whole asio instance
         asio::io_context& m_asioContext;
 
         // This queue holds all messages to be sent to the remote side
-        // of this connection
-        tsqueue<message<T>> m_qMessagesOut;
+        // of this connection. It is only ever touched from the asio context,
+        // so it needs no locking of its own.
+        std::deque<outgoing_message<T>> m_qMessagesOut;
+
+        // Buffer sequence of the write currently in flight, and how many messages
+        // (and bytes) from the front of the outgoing queue it covers
+        std::vector<asio::const_buffer> m_vWriteBuffers;
+        size_t m_nMessagesInFlight = 0;
+        size_t m_nBytesInFlight = 0;
+
+        // Bounds on the outgoing queue. The counters are written on the strand
+        // but may be read from any thread.
+        send_limits m_sendLimits;
+        std::atomic<size_t> m_nQueuedBytes{ 0 };
+        std::atomic<uint64_t> m_nDroppedMessages{ 0 };
+        std::atomic<bool> m_bAboveHighWatermark{ false };
+
+        // Traffic counters, see net_metrics.h
+        connection_metrics m_metrics;
+        uint64_t m_nCreatedAt = 0;
+
+        // Coalescing limits for a single write
+        size_t m_nMaxWriteBytes = 64 * 1024;
+        size_t m_nMaxWriteBuffers = 64;
 
         // This references the incoming queue of the parent object
-        tsqueue<owned_message<T>>& m_qMessagesIn;
+        incoming_queue<T>& m_qMessagesIn;
 
         // Incoming messages are constructed asynchronously, so we will
         // store the part assembled message here, until it is ready
         message<T> m_msgTemporaryIn;
 
+        // Buffered read mode: bytes in [m_nReadStart, m_nReadEnd) of the read
+        // buffer have been received but not yet parsed into messages
+        static constexpr size_t nReadBufferSize = 16 * 1024;
+        read_mode m_nReadMode = read_mode::framed;
+        std::vector<uint8_t> m_vReadBuffer;
+        size_t m_nReadStart = 0;
+        size_t m_nReadEnd = 0;
+
         // The "owner" decides how some of the connection behaves
         owner m_nOwnerType = owner::server;
 
@@ -336,6 +934,38 @@ template<typename T>
         bool m_bValidHandshake = false;
         bool m_bConnectionEstablished = false;
 
+        // Whether the socket is open, or being connected, for IsConnected()
+        std::atomic<bool> m_bOpen{ false };
+
+        // Client side: set until the answer to the puzzle has been written, while the
+        // outgoing queue is held back. m_bWriteHandshake puts the answer at the head of
+        // the next write.
+        bool m_bHandshakePending = false;
+        bool m_bWriteHandshake = false;
+
+        // Client side: the outgoing queue outlives the socket, see SetHoldWhileClosed()
+        bool m_bHoldWhileClosed = false;
+        size_t m_nMaxHeldBytes = 0;
+
         uint32_t id = 0;
 
+        // Server that owns this connection, told about watermark crossings
+        server_interface<T>* m_pServer = nullptr;
+
+        // Client side: requests waiting for their response
+        request_table<T>* m_pRequests = nullptr;
+
+        // Client side: the client told about the connection coming and going
+        client_interface<T>* m_pClient = nullptr;
+
+        // Deadlines, and when the connection last received and sent anything. Only
+        // touched on the strand, except that the wheel fires the timer.
+        timeouts m_timeouts;
+        std::shared_ptr<const message<T>> m_pHeartbeat;
+        std::chrono::steady_clock::time_point m_tLastReceive;
+        std::chrono::steady_clock::time_point m_tLastSend;
+        bool m_bRelease = false;
+        // Declared last, so it is cancelled before anything it could touch is destroyed
+        wheel_timer m_deadline;
+
 };
\ No newline at end of file
@@ -1,8 +1,20 @@
 #pragma once
 
 #include "net_common.h"
+#include "net_buffer.h"
+#include "net_histogram.h"
+#include "net_metrics.h"
+#include "net_log.h"
 #include "net_message.h"
+#include "net_message_view.h"
+#include "net_schema.h"
 #include "net_client.h"
 #include "net_tsqueue.h"
+#include "net_mpscqueue.h"
+#include "net_registry.h"
+#include "net_timer_wheel.h"
+#include "net_slab.h"
+#include "net_handler_pool.h"
+#include "net_request.h"
 #include "net_server.h"
 #include "net_connection.h"
\ No newline at end of file
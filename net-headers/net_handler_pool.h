@@ -0,0 +1,206 @@
+#pragma once
+#include "net_common.h"
+#include "net_log.h"
+#include <functional>
+
+// Runs a handler over items on a pool of threads while keeping the order of the items
+// pushed under each key. Keys hash to serial lanes: a lane is only ever run by one
+// thread at a time, so the items of one key are handled one after another in the order
+// they were pushed, while different lanes run side by side. A lane with work waits on
+// the deque of the thread it belongs to, and a thread with nothing of its own steals a
+// waiting lane from the back of another thread's deque, so a slow item holds up its own
+// lane only. Lanes are stolen whole, never single items, which is what keeps the order.
+template<typename Item>
+class handler_pool{
+    public:
+        // Items a thread handles from one lane before putting it back behind the
+        // other lanes waiting on that thread
+        static constexpr size_t nLaneBatch = 32;
+
+        // nThreads 0 picks one per hardware thread, nLanes 0 picks 16 per thread. More
+        // lanes make it less likely that two busy keys share one.
+        handler_pool(size_t nThreads, size_t nLanes, std::function<void(Item&)> fnHandler)
+            : m_fnHandler(std::move(fnHandler)){
+            nThreads = nThreads > 0 ? nThreads : std::max<size_t>(std::thread::hardware_concurrency(), 1);
+            nLanes = std::max(nLanes > 0 ? nLanes : nThreads * 16, nThreads);
+
+            for (size_t i = 0; i < nLanes; i++)
+                m_vLanes.push_back(std::make_unique<lane>());
+            for (size_t i = 0; i < nThreads; i++)
+                m_vWorkers.push_back(std::make_unique<worker>());
+            for (size_t i = 0; i < nThreads; i++)
+                m_vWorkers[i]->thread = std::thread([this, i]() { Run(i); });
+        }
+
+        handler_pool(const handler_pool&) = delete;
+        handler_pool& operator=(const handler_pool&) = delete;
+
+        ~handler_pool(){
+            stop();
+        }
+
+        // Queue an item on the lane of nKey
+        void push(uint64_t nKey, Item&& item){
+            size_t nLane = size_t((nKey * 0x9E3779B97F4A7C15ull) >> 32) % m_vLanes.size();
+            lane& l = *m_vLanes[nLane];
+
+            bool bSchedule = false;
+            {
+                std::scoped_lock lock(l.mux);
+                l.qItems.push_back(std::move(item));
+                m_nPending.fetch_add(1, std::memory_order_relaxed);
+                bSchedule = !l.bScheduled;
+                l.bScheduled = true;
+            }
+
+            // The lane was idle, so nobody is running it and it is on no deque
+            if (bSchedule)
+                Schedule(l, nLane % m_vWorkers.size());
+        }
+
+        // Items pushed and not yet handled
+        size_t pending() const{
+            return m_nPending.load(std::memory_order_relaxed);
+        }
+
+        size_t threads() const{
+            return m_vWorkers.size();
+        }
+
+        // Let the handlers running finish, then stop the threads. Items still queued
+        // are dropped with the pool.
+        void stop(){
+            {
+                std::scoped_lock lock(m_muxSleep);
+                m_bStopping = true;
+            }
+            m_cvSleep.notify_all();
+
+            for (auto& w : m_vWorkers)
+                if (w->thread.joinable()) w->thread.join();
+        }
+
+    private:
+        struct lane{
+            std::mutex mux;
+            std::deque<Item> qItems;
+            // Set while the lane waits on a deque or is being run
+            bool bScheduled = false;
+        };
+
+        struct worker{
+            std::mutex mux;
+            std::deque<lane*> qReady;
+            // Items taken from the lane being run, kept to reuse its memory
+            std::deque<Item> qBatch;
+            std::thread thread;
+        };
+
+        // Put a lane with work on a thread's deque and wake a thread if any sleeps
+        void Schedule(lane& l, size_t nWorker){
+            // Counted before it can be taken, so the count never drops below the lanes
+            // actually waiting
+            m_nReady.fetch_add(1, std::memory_order_seq_cst);
+            {
+                std::scoped_lock lock(m_vWorkers[nWorker]->mux);
+                m_vWorkers[nWorker]->qReady.push_back(&l);
+            }
+
+            // A thread going to sleep registers before checking for ready lanes, this
+            // counts the lane before checking for sleepers, so one sees the other
+            if (m_nSleeping.load(std::memory_order_seq_cst) > 0){
+                std::scoped_lock lock(m_muxSleep);
+                m_cvSleep.notify_one();
+            }
+        }
+
+        // The oldest lane waiting on this thread, or else one stolen from another
+        lane* Take(size_t nWorker){
+            for (size_t k = 0; k < m_vWorkers.size(); k++){
+                worker& w = *m_vWorkers[(nWorker + k) % m_vWorkers.size()];
+                std::scoped_lock lock(w.mux);
+                if (w.qReady.empty())
+                    continue;
+
+                lane* pLane = nullptr;
+                if (k == 0){
+                    pLane = w.qReady.front();
+                    w.qReady.pop_front();
+                }
+                else{
+                    pLane = w.qReady.back();
+                    w.qReady.pop_back();
+                }
+                m_nReady.fetch_sub(1, std::memory_order_relaxed);
+                return pLane;
+            }
+            return nullptr;
+        }
+
+        void Run(size_t nWorker){
+            worker& w = *m_vWorkers[nWorker];
+            while (true){
+                lane* pLane = Take(nWorker);
+                if (pLane == nullptr){
+                    // Nothing anywhere, sleep until a lane is scheduled
+                    std::unique_lock<std::mutex> ul(m_muxSleep);
+                    m_nSleeping.fetch_add(1, std::memory_order_seq_cst);
+                    m_cvSleep.wait(ul, [this]{ return m_bStopping.load() || m_nReady.load(std::memory_order_seq_cst) > 0; });
+                    m_nSleeping.fetch_sub(1, std::memory_order_relaxed);
+                    if (m_bStopping)
+                        return;
+                    continue;
+                }
+
+                if (m_bStopping.load(std::memory_order_relaxed))
+                    return;
+
+                // Take a batch off the lane, so pushing to it is not held up by the handler
+                {
+                    std::scoped_lock lock(pLane->mux);
+                    size_t nCount = std::min(pLane->qItems.size(), nLaneBatch);
+                    std::move(pLane->qItems.begin(), pLane->qItems.begin() + nCount, std::back_inserter(w.qBatch));
+                    pLane->qItems.erase(pLane->qItems.begin(), pLane->qItems.begin() + nCount);
+                }
+
+                for (auto& item : w.qBatch){
+                    try{
+                        m_fnHandler(item);
+                    }
+                    catch (std::exception& e){
+                        NET_LOG_ERROR("[HANDLER] exception: " << e.what());
+                    }
+                    catch (...){
+                        NET_LOG_ERROR("[HANDLER] unknown exception");
+                    }
+                }
+                m_nPending.fetch_sub(w.qBatch.size(), std::memory_order_relaxed);
+                w.qBatch.clear();
+
+                // Go round again if more arrived meanwhile, behind the lanes already waiting
+                bool bMore = false;
+                {
+                    std::scoped_lock lock(pLane->mux);
+                    bMore = !pLane->qItems.empty();
+                    if (!bMore)
+                        pLane->bScheduled = false;
+                }
+                if (bMore)
+                    Schedule(*pLane, nWorker);
+            }
+        }
+
+    private:
+        std::function<void(Item&)> m_fnHandler;
+        std::vector<std::unique_ptr<lane>> m_vLanes;
+        std::vector<std::unique_ptr<worker>> m_vWorkers;
+
+        // Lanes waiting on any deque, and threads asleep waiting for one
+        std::atomic<size_t> m_nReady{ 0 };
+        std::atomic<size_t> m_nSleeping{ 0 };
+        std::atomic<size_t> m_nPending{ 0 };
+
+        std::mutex m_muxSleep;
+        std::condition_variable m_cvSleep;
+        std::atomic<bool> m_bStopping{ false };
+};
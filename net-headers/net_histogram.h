@@ -0,0 +1,144 @@
+#pragma once
+#include "net_common.h"
+
+// Log-linear histogram of unsigned values (typically latencies in nanoseconds), in the
+// style of HdrHistogram. Values below 2^nPrecisionBits are counted exactly, above that
+// every power of two is split into 2^(nPrecisionBits-1) equal buckets, so any recorded
+// value is reported within 1 part in 2^(nPrecisionBits-1) of its true value while the
+// whole 64-bit range takes a fixed, small number of counters.
+// record() may be called from any thread, it is a single relaxed atomic increment.
+// Readers see a consistent enough picture for reporting, not an exact snapshot.
+template<uint32_t nPrecisionBits = 7>
+class latency_histogram{
+    public:
+        static_assert(nPrecisionBits >= 2 && nPrecisionBits <= 16, "Unsupported histogram precision");
+
+        static constexpr uint32_t nSubBuckets = 1u << nPrecisionBits;
+        static constexpr uint32_t nHalfBuckets = nSubBuckets / 2;
+        static constexpr size_t nBuckets = nSubBuckets + (64 - nPrecisionBits) * nHalfBuckets;
+
+        latency_histogram(){
+            reset();
+        }
+
+        latency_histogram(const latency_histogram& other){
+            reset();
+            merge(other);
+        }
+
+        latency_histogram& operator=(const latency_histogram& other){
+            if (this != &other){
+                reset();
+                merge(other);
+            }
+            return *this;
+        }
+
+    public:
+        // Count one occurence of nValue
+        void record(uint64_t nValue){
+            m_aCounts[BucketOf(nValue)].fetch_add(1, std::memory_order_relaxed);
+            m_nCount.fetch_add(1, std::memory_order_relaxed);
+            m_nSum.fetch_add(nValue, std::memory_order_relaxed);
+
+            uint64_t nMin = m_nMin.load(std::memory_order_relaxed);
+            while (nValue < nMin && !m_nMin.compare_exchange_weak(nMin, nValue, std::memory_order_relaxed));
+            uint64_t nMax = m_nMax.load(std::memory_order_relaxed);
+            while (nValue > nMax && !m_nMax.compare_exchange_weak(nMax, nValue, std::memory_order_relaxed));
+        }
+
+        // Add every value counted by other to this histogram
+        void merge(const latency_histogram& other){
+            for (size_t i = 0; i < nBuckets; i++){
+                uint64_t n = other.m_aCounts[i].load(std::memory_order_relaxed);
+                if (n > 0)
+                    m_aCounts[i].fetch_add(n, std::memory_order_relaxed);
+            }
+            m_nCount.fetch_add(other.count(), std::memory_order_relaxed);
+            m_nSum.fetch_add(other.m_nSum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+            if (other.count() > 0){
+                uint64_t nMin = m_nMin.load(std::memory_order_relaxed);
+                while (other.min() < nMin && !m_nMin.compare_exchange_weak(nMin, other.min(), std::memory_order_relaxed));
+                uint64_t nMax = m_nMax.load(std::memory_order_relaxed);
+                while (other.max() > nMax && !m_nMax.compare_exchange_weak(nMax, other.max(), std::memory_order_relaxed));
+            }
+        }
+
+        void reset(){
+            for (auto& n : m_aCounts)
+                n.store(0, std::memory_order_relaxed);
+            m_nCount.store(0, std::memory_order_relaxed);
+            m_nSum.store(0, std::memory_order_relaxed);
+            m_nMin.store(UINT64_MAX, std::memory_order_relaxed);
+            m_nMax.store(0, std::memory_order_relaxed);
+        }
+
+        uint64_t count() const { return m_nCount.load(std::memory_order_relaxed); }
+        uint64_t min() const { return count() > 0 ? m_nMin.load(std::memory_order_relaxed) : 0; }
+        uint64_t max() const { return m_nMax.load(std::memory_order_relaxed); }
+
+        double mean() const{
+            uint64_t n = count();
+            return n > 0 ? double(m_nSum.load(std::memory_order_relaxed)) / double(n) : 0.0;
+        }
+
+        // Smallest value v such that at least dPercentile % of the recorded values are <= v,
+        // give or take the bucket resolution. percentile(50) is the median.
+        uint64_t percentile(double dPercentile) const{
+            uint64_t nTotal = count();
+            if (nTotal == 0)
+                return 0;
+
+            uint64_t nRank = uint64_t(std::ceil(std::clamp(dPercentile, 0.0, 100.0) / 100.0 * double(nTotal)));
+            nRank = std::max<uint64_t>(nRank, 1);
+
+            uint64_t nSeen = 0;
+            for (size_t i = 0; i < nBuckets; i++){
+                nSeen += m_aCounts[i].load(std::memory_order_relaxed);
+                if (nSeen >= nRank)
+                    return std::min(HighestEquivalent(i), max());
+            }
+            return max();
+        }
+
+    private:
+        // Exact for small values, otherwise (power of two, top bits of the mantissa)
+        static size_t BucketOf(uint64_t nValue){
+            if (nValue < nSubBuckets)
+                return size_t(nValue);
+
+            uint32_t nMsb = 63 - uint32_t(CountLeadingZeros(nValue));
+            uint32_t nShift = nMsb - (nPrecisionBits - 1);
+            uint64_t nSub = nValue >> nShift;
+            return nSubBuckets + size_t(nShift - 1) * nHalfBuckets + size_t(nSub - nHalfBuckets);
+        }
+
+        // Largest value that lands in bucket i
+        static uint64_t HighestEquivalent(size_t i){
+            if (i < nSubBuckets)
+                return uint64_t(i);
+
+            uint32_t nShift = uint32_t((i - nSubBuckets) / nHalfBuckets) + 1;
+            uint64_t nSub = uint64_t((i - nSubBuckets) % nHalfBuckets) + nHalfBuckets;
+            return ((nSub + 1) << nShift) - 1;
+        }
+
+        static int CountLeadingZeros(uint64_t nValue){
+#if defined(__GNUC__) || defined(__clang__)
+            return __builtin_clzll(nValue);
+#else
+            int n = 0;
+            for (uint64_t nBit = uint64_t(1) << 63; (nValue & nBit) == 0; nBit >>= 1)
+                n++;
+            return n;
+#endif
+        }
+
+    private:
+        std::array<std::atomic<uint64_t>, nBuckets> m_aCounts;
+        std::atomic<uint64_t> m_nCount{ 0 };
+        std::atomic<uint64_t> m_nSum{ 0 };
+        std::atomic<uint64_t> m_nMin{ UINT64_MAX };
+        std::atomic<uint64_t> m_nMax{ 0 };
+};
@@ -0,0 +1,271 @@
+#pragma once
+#include "net_common.h"
+#include <charconv>
+#include <cstdio>
+#include <sstream>
+#include <string_view>
+
+enum class log_level : int{
+    trace,
+    debug,
+    info,
+    warn,
+    error,
+    off
+};
+
+// Compile time threshold: statements below it compile to nothing, their arguments are
+// never evaluated. Override with -DNET_LOG_LEVEL=0 (trace) .. 5 (off).
+#ifndef NET_LOG_LEVEL
+#define NET_LOG_LEVEL 2
+#endif
+
+// One log line, formatted by the thread that logs it. Fixed size so it can sit in the
+// logger's ring without any allocation, longer text is truncated.
+struct log_record{
+    static constexpr size_t nMaxText = 240;
+
+    log_level level = log_level::info;
+    uint16_t nLength = 0;
+    char sText[nMaxText];
+
+    log_record& operator << (char c){
+        Append(&c, 1);
+        return *this;
+    }
+
+    // Strings and numbers are formatted in place, anything else goes through its
+    // std::ostream operator, which is slower but only used on cold paths
+    template<typename V>
+    log_record& operator << (const V& v){
+        if constexpr (std::is_convertible_v<const V&, std::string_view>){
+            std::string_view s = v;
+            Append(s.data(), s.size());
+        }
+        else if constexpr (std::is_same_v<V, bool>){
+            *this << (v ? "true" : "false");
+        }
+        else if constexpr (std::is_integral_v<V>){
+            char sNumber[24];
+            auto result = std::to_chars(sNumber, sNumber + sizeof(sNumber), v);
+            Append(sNumber, size_t(result.ptr - sNumber));
+        }
+        else if constexpr (std::is_enum_v<V>){
+            *this << static_cast<std::underlying_type_t<V>>(v);
+        }
+        else if constexpr (std::is_floating_point_v<V>){
+            char sNumber[32];
+            int n = std::snprintf(sNumber, sizeof(sNumber), "%g", double(v));
+            Append(sNumber, size_t(std::max(n, 0)));
+        }
+        else{
+            std::ostringstream os;
+            os << v;
+            *this << os.str();
+        }
+        return *this;
+    }
+
+    private:
+        void Append(const char* s, size_t n){
+            n = std::min(n, nMaxText - nLength);
+            std::memcpy(sText + nLength, s, n);
+            nLength = uint16_t(nLength + n);
+        }
+};
+
+// Asynchronous logger. Logging threads copy their preformatted record into a bounded
+// lock-free ring, and a background thread writes the records out in batches, so the io
+// threads never wait for the console. If the ring is full the record is dropped and
+// counted rather than blocking the caller.
+class async_logger{
+    public:
+        static constexpr size_t nCapacity = 4096;
+
+        // Shared by the whole process. Destroyed at exit, after writing what is left.
+        static async_logger& instance(){
+            static async_logger logger;
+            return logger;
+        }
+
+        async_logger(const async_logger&) = delete;
+        async_logger& operator=(const async_logger&) = delete;
+
+        ~async_logger(){
+            m_bStop.store(true);
+            Wake();
+            if (m_thrWriter.joinable())
+                m_thrWriter.join();
+        }
+
+    public:
+        // Runtime threshold, on top of the compile time one
+        void SetLevel(log_level level){
+            m_nLevel.store(level, std::memory_order_relaxed);
+        }
+
+        bool Enabled(log_level level) const{
+            return level >= m_nLevel.load(std::memory_order_relaxed);
+        }
+
+        // Where records are written, stdout by default
+        void SetOutput(std::FILE* pFile){
+            std::scoped_lock lock(m_muxOutput);
+            m_pOutput = pFile;
+        }
+
+        // Queue a record. Safe from any thread, never blocks.
+        void Push(const log_record& record){
+            size_t nPos = m_nEnqueuePos.load(std::memory_order_relaxed);
+            slot* pSlot;
+            for (;;){
+                pSlot = &m_vSlots[nPos & (nCapacity - 1)];
+                size_t nSeq = pSlot->nSeq.load(std::memory_order_acquire);
+                intptr_t nDiff = intptr_t(nSeq) - intptr_t(nPos);
+                if (nDiff == 0){
+                    if (m_nEnqueuePos.compare_exchange_weak(nPos, nPos + 1, std::memory_order_relaxed))
+                        break;
+                }
+                else if (nDiff < 0){
+                    // The writer has fallen a whole ring behind
+                    m_nDropped.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+                else{
+                    nPos = m_nEnqueuePos.load(std::memory_order_relaxed);
+                }
+            }
+
+            pSlot->record.level = record.level;
+            pSlot->record.nLength = record.nLength;
+            std::memcpy(pSlot->record.sText, record.sText, record.nLength);
+            pSlot->nSeq.store(nPos + 1, std::memory_order_seq_cst);
+
+            if (m_nWaiters.load(std::memory_order_seq_cst) > 0)
+                Wake();
+        }
+
+        // Block until everything logged so far has been written
+        void Flush(){
+            size_t nTarget = m_nEnqueuePos.load(std::memory_order_acquire);
+            while (m_nWritten.load(std::memory_order_acquire) < nTarget){
+                Wake();
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+
+        // Records dropped because the ring was full
+        uint64_t Dropped() const{
+            return m_nDropped.load(std::memory_order_relaxed);
+        }
+
+    private:
+        async_logger() : m_vSlots(nCapacity){
+            for (size_t i = 0; i < nCapacity; i++)
+                m_vSlots[i].nSeq.store(i, std::memory_order_relaxed);
+            m_thrWriter = std::thread([this]() { Run(); });
+        }
+
+        struct slot{
+            std::atomic<size_t> nSeq{ 0 };
+            log_record record;
+        };
+
+        void Wake(){
+            std::unique_lock<std::mutex> ul(m_muxBlocking);
+            m_cvBlocking.notify_one();
+        }
+
+        // Writer thread: move whatever is in the ring into one buffer, write it with a
+        // single call, and sleep when there is nothing to do
+        void Run(){
+            std::string sBatch;
+            uint64_t nReportedDrops = 0;
+
+            for (;;){
+                sBatch.clear();
+                size_t nTaken = 0;
+                for (;;){
+                    slot& s = m_vSlots[m_nDequeuePos & (nCapacity - 1)];
+                    if (s.nSeq.load(std::memory_order_acquire) != m_nDequeuePos + 1)
+                        break;
+
+                    sBatch.append(s.record.sText, s.record.nLength);
+                    sBatch.push_back('\n');
+                    s.nSeq.store(m_nDequeuePos + nCapacity, std::memory_order_release);
+                    m_nDequeuePos++;
+                    nTaken++;
+                }
+
+                uint64_t nDropped = Dropped();
+                if (nDropped != nReportedDrops){
+                    sBatch += "[LOG] " + std::to_string(nDropped - nReportedDrops) + " messages dropped\n";
+                    nReportedDrops = nDropped;
+                }
+
+                if (!sBatch.empty()){
+                    std::scoped_lock lock(m_muxOutput);
+                    std::fwrite(sBatch.data(), 1, sBatch.size(), m_pOutput);
+                    std::fflush(m_pOutput);
+                }
+                m_nWritten.store(m_nDequeuePos, std::memory_order_release);
+
+                if (nTaken > 0)
+                    continue;
+                if (m_bStop.load())
+                    return;
+
+                // Producers only take the mutex to wake us when they see a waiter
+                m_nWaiters.fetch_add(1, std::memory_order_seq_cst);
+                {
+                    std::unique_lock<std::mutex> ul(m_muxBlocking);
+                    m_cvBlocking.wait_for(ul, std::chrono::milliseconds(100), [this](){
+                        return m_bStop.load() || HasRecords();
+                    });
+                }
+                m_nWaiters.fetch_sub(1, std::memory_order_relaxed);
+            }
+        }
+
+        bool HasRecords() const{
+            const slot& s = m_vSlots[m_nDequeuePos & (nCapacity - 1)];
+            return s.nSeq.load(std::memory_order_seq_cst) == m_nDequeuePos + 1;
+        }
+
+    private:
+        std::vector<slot> m_vSlots;
+        alignas(64) std::atomic<size_t> m_nEnqueuePos{ 0 };
+        alignas(64) size_t m_nDequeuePos = 0;
+        std::atomic<size_t> m_nWritten{ 0 };
+        std::atomic<uint64_t> m_nDropped{ 0 };
+        std::atomic<log_level> m_nLevel{ log_level::trace };
+
+        std::atomic<int> m_nWaiters{ 0 };
+        std::atomic<bool> m_bStop{ false };
+        std::mutex m_muxBlocking;
+        std::condition_variable m_cvBlocking;
+
+        std::mutex m_muxOutput;
+        std::FILE* m_pOutput = stdout;
+
+        std::thread m_thrWriter;
+};
+
+// Log a line, streaming the arguments: NET_LOG_INFO("[" << id << "] Connected");
+#define NET_LOG(lvl, expr) \
+    do{ \
+        if constexpr (int(lvl) >= NET_LOG_LEVEL){ \
+            if (async_logger::instance().Enabled(lvl)){ \
+                log_record netLogRecord; \
+                netLogRecord.level = lvl; \
+                netLogRecord << expr; \
+                async_logger::instance().Push(netLogRecord); \
+            } \
+        } \
+    } while (0)
+
+#define NET_LOG_TRACE(expr) NET_LOG(log_level::trace, expr)
+#define NET_LOG_DEBUG(expr) NET_LOG(log_level::debug, expr)
+#define NET_LOG_INFO(expr) NET_LOG(log_level::info, expr)
+#define NET_LOG_WARN(expr) NET_LOG(log_level::warn, expr)
+#define NET_LOG_ERROR(expr) NET_LOG(log_level::error, expr)
@@ -1,19 +1,25 @@
 #pragma once    
 #include "net_common.h"
+#include "net_buffer.h"
 
 template <typename T>
 struct message_header{
     T id{};
     uint32_t size = 0;
+    // Ties a response to its request, so several requests can be in flight at once.
+    // 0 means the message is not part of a request. A server answering a request
+    // copies it from the request into the response.
+    uint32_t correlation = 0;
 };
 
-// Message Body contains a header and a std::vector, containing raw bytes
+// Message Body contains a header and a message_body, containing raw bytes
 // of infomation. Message has variable length but should update the header size.
+// The body keeps small payloads inline and borrows larger ones from the buffer pool.
 template <typename T>
 struct message{
-    // Header & Body vector
+    // Header & Body storage
     message_header<T> header{};
-    std::vector<uint8_t> body;
+    message_body body;
 
     // returns size of entire message packet in bytes
     size_t size() const{
@@ -71,7 +77,81 @@ struct message{
 
         // Return the target message so it can be "chained"
         return msg;
-    }			
+    }
+
+    // Pushing an array in one go: the elements are copied in with a single memcpy and
+    // followed by their count, so it pops back off the stack as one item.
+    template<typename DataType>
+    void push_span(const DataType* pData, size_t nCount){
+        append(pData, nCount);
+        *this << uint32_t(nCount);
+    }
+
+    // Appending an array with no count, for a reader that knows how many elements
+    // follow: typically a count pushed first, then read front to back by a message_view.
+    template<typename DataType>
+    void append(const DataType* pData, size_t nCount){
+        static_assert(std::is_standard_layout<DataType>::value, "Data is too complex to be pushed into vector");
+
+        size_t i = body.size();
+        body.resize(i + nCount * sizeof(DataType));
+        if (nCount > 0)
+            std::memcpy(body.data() + i, pData, nCount * sizeof(DataType));
+
+        header.size = size();
+    }
+
+    // Pulling an array pushed with push_span, elements keep their original order.
+    // A body too short to hold the count gives an empty array, and a count larger
+    // than what is left in the body is cut down to what is there, so a malformed
+    // message cannot make it read past the start of the body.
+    template<typename DataType>
+    void pull_span(std::vector<DataType>& vData){
+        static_assert(std::is_standard_layout<DataType>::value, "Data is too complex to be pulled from vector");
+
+        if (body.size() < sizeof(uint32_t)){
+            vData.clear();
+            return;
+        }
+
+        uint32_t nElements = 0;
+        *this >> nElements;
+        size_t nCount = std::min<size_t>(nElements, body.size() / sizeof(DataType));
+
+        size_t i = body.size() - nCount * sizeof(DataType);
+        vData.resize(nCount);
+        if (nCount > 0)
+            std::memcpy(vData.data(), body.data() + i, nCount * sizeof(DataType));
+        body.resize(i);
+
+        header.size = size();
+    }
+
+    template<typename DataType>
+    friend message<T>& operator << (message<T>& msg, const std::vector<DataType>& vData){
+        msg.push_span(vData.data(), vData.size());
+        return msg;
+    }
+
+    template<typename DataType>
+    friend message<T>& operator >> (message<T>& msg, std::vector<DataType>& vData){
+        msg.pull_span(vData);
+        return msg;
+    }
+};
+
+// A message waiting in a connection's outgoing queue. Usually the queue owns the
+// message outright, but a broadcast shares one immutable message between every
+// connection it is sent to, so the body is never copied per recipient.
+template <typename T>
+struct outgoing_message{
+    message<T> msg;
+    std::shared_ptr<const message<T>> shared = nullptr;
+
+    // The message to put on the wire
+    const message<T>& get() const{
+        return shared ? *shared : msg;
+    }
 };
 
 template <typename T>
@@ -81,6 +161,8 @@ template <typename T>
 struct owned_message{
     std::shared_ptr<connection<T>> remote = nullptr;
     message<T> msg;
+    // When the message arrived, for the dispatch latency metrics (0 if they are off)
+    uint64_t nReceivedAt = 0;
 
     // friendly string maker
     friend std::ostream& operator<<(std::ostream& os, const owned_message<T>& msg){
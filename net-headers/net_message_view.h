@@ -0,0 +1,115 @@
+#pragma once
+#include "net_common.h"
+#include "net_message.h"
+
+#if __cplusplus >= 202002L && __has_include(<span>)
+#include <span>
+#endif
+
+// Read only window onto an array inside a message body
+#if defined(__cpp_lib_span)
+template<typename DataType>
+using message_span = std::span<const DataType>;
+#else
+template<typename DataType>
+struct message_span{
+    message_span() = default;
+    message_span(const DataType* pData, size_t nSize) : m_pData(pData), m_nSize(nSize){}
+
+    const DataType* data() const { return m_pData; }
+    size_t size() const { return m_nSize; }
+    bool empty() const { return m_nSize == 0; }
+    const DataType* begin() const { return m_pData; }
+    const DataType* end() const { return m_pData + m_nSize; }
+    const DataType& operator[](size_t i) const { return m_pData[i]; }
+
+    private:
+        const DataType* m_pData = nullptr;
+        size_t m_nSize = 0;
+};
+#endif
+
+// Forward read cursor over a message. Fields come out in the order they were pushed
+// with <<, straight from the body: the message is never modified or reallocated, and
+// arrays can be used in place through read_span(). Reads are bounds checked against
+// the smaller of header.size and the body. Like a stream, a read that does not fit
+// fails the view, leaves its target untouched and makes every later read fail too,
+// so a whole message can be parsed and checked once at the end.
+//   message_view view(msg);
+//   view >> x >> y;
+//   if (!view) ...
+template <typename T>
+class message_view{
+    public:
+        explicit message_view(const message<T>& msg)
+            : m_pData(msg.body.data()), m_nSize(std::min<size_t>(msg.header.size, msg.body.size())){}
+
+        explicit operator bool() const { return !m_bFailed; }
+        bool failed() const { return m_bFailed; }
+
+        // Bytes not read yet
+        size_t remaining() const { return m_nSize - m_nOffset; }
+
+        // Pulling the next field
+        template<typename DataType>
+        friend message_view& operator >> (message_view& view, DataType& data){
+            static_assert(std::is_standard_layout<DataType>::value, "Data is too complex to be pulled from vector");
+
+            if (const uint8_t* p = view.Take(sizeof(DataType)))
+                std::memcpy(&data, p, sizeof(DataType));
+            return view;
+        }
+
+        // The next nCount elements, without copying. Fails if they are not all there,
+        // or if they do not sit at an address aligned for DataType, in which case
+        // read() copies them out instead.
+        template<typename DataType>
+        message_span<DataType> read_span(size_t nCount){
+            static_assert(std::is_standard_layout<DataType>::value, "Data is too complex to be pulled from vector");
+
+            if (m_bFailed || nCount > remaining() / sizeof(DataType)
+                || reinterpret_cast<uintptr_t>(m_pData + m_nOffset) % alignof(DataType) != 0){
+                m_bFailed = true;
+                return {};
+            }
+            const uint8_t* p = Take(nCount * sizeof(DataType));
+            return message_span<DataType>(reinterpret_cast<const DataType*>(p), nCount);
+        }
+
+        // Copy the next nCount elements out
+        template<typename DataType>
+        bool read(DataType* pData, size_t nCount){
+            static_assert(std::is_standard_layout<DataType>::value, "Data is too complex to be pulled from vector");
+
+            if (m_bFailed || nCount > remaining() / sizeof(DataType)){
+                m_bFailed = true;
+                return false;
+            }
+            if (nCount > 0)
+                std::memcpy(pData, Take(nCount * sizeof(DataType)), nCount * sizeof(DataType));
+            return true;
+        }
+
+        // Step over bytes that are not needed
+        bool skip(size_t nBytes){
+            return Take(nBytes) != nullptr;
+        }
+
+    private:
+        // Advance the cursor, nullptr if there are not enough bytes left
+        const uint8_t* Take(size_t nBytes){
+            if (m_bFailed || nBytes > remaining()){
+                m_bFailed = true;
+                return nullptr;
+            }
+            const uint8_t* p = m_pData + m_nOffset;
+            m_nOffset += nBytes;
+            return p;
+        }
+
+    private:
+        const uint8_t* m_pData = nullptr;
+        size_t m_nSize = 0;
+        size_t m_nOffset = 0;
+        bool m_bFailed = false;
+};
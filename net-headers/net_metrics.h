@@ -0,0 +1,206 @@
+#pragma once
+#include "net_common.h"
+#include "net_histogram.h"
+
+// Metrics are on by default. Defining NET_DISABLE_METRICS swaps every connection's
+// counters for an empty implementation, so they cost nothing at all.
+#ifdef NET_DISABLE_METRICS
+#define NET_METRICS_ENABLED false
+#else
+#define NET_METRICS_ENABLED true
+#endif
+
+// Counter on a cache line of its own, so counters written by different threads never
+// bounce the same line between cores. Every counter has a single writer (a connection's
+// strand, or the thread calling Update()), so a plain load and store is enough and is
+// cheaper than an atomic add. Any thread may read.
+struct alignas(64) metrics_counter{
+    void add(uint64_t n){
+        m_n.store(m_n.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    void set(uint64_t n){
+        m_n.store(n, std::memory_order_relaxed);
+    }
+
+    uint64_t get() const{
+        return m_n.load(std::memory_order_relaxed);
+    }
+
+    private:
+        std::atomic<uint64_t> m_n{ 0 };
+};
+
+// Point in time copy of one connection's metrics
+struct connection_metrics_snapshot{
+    uint32_t nID = 0;
+    uint64_t nMessagesIn = 0;
+    uint64_t nMessagesOut = 0;
+    uint64_t nBytesIn = 0;
+    uint64_t nBytesOut = 0;
+    // Messages and bytes waiting in the outgoing queue
+    uint64_t nQueueDepth = 0;
+    uint64_t nQueuedBytes = 0;
+    // Messages discarded by the send limits
+    uint64_t nDropped = 0;
+    // From accepting the socket to the client passing validation
+    uint64_t nHandshakeNs = 0;
+    // From a message arriving to its handler being called
+    uint64_t nDispatchCount = 0;
+    uint64_t nDispatchP50Ns = 0;
+    uint64_t nDispatchP99Ns = 0;
+    uint64_t nDispatchMaxNs = 0;
+};
+
+template<bool bEnabled>
+class basic_connection_metrics;
+
+// Counters kept by every connection
+template<>
+class basic_connection_metrics<true>{
+    public:
+        static constexpr bool bEnabled = true;
+
+        // Timestamp used for the latency measurements
+        static uint64_t Now(){
+            return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+        }
+
+        void MessageIn(size_t nBytes){
+            m_nMessagesIn.add(1);
+            m_nBytesIn.add(nBytes);
+        }
+
+        void MessagesOut(size_t nMessages, size_t nBytes){
+            m_nMessagesOut.add(nMessages);
+            m_nBytesOut.add(nBytes);
+        }
+
+        void QueueDepth(size_t nMessages){
+            m_nQueueDepth.set(nMessages);
+        }
+
+        void Handshake(uint64_t nNs){
+            m_nHandshakeNs.set(nNs);
+        }
+
+        void Dispatch(uint64_t nNs){
+            m_histDispatch.record(nNs);
+        }
+
+        void Fill(connection_metrics_snapshot& s) const{
+            s.nMessagesIn = m_nMessagesIn.get();
+            s.nMessagesOut = m_nMessagesOut.get();
+            s.nBytesIn = m_nBytesIn.get();
+            s.nBytesOut = m_nBytesOut.get();
+            s.nQueueDepth = m_nQueueDepth.get();
+            s.nHandshakeNs = m_nHandshakeNs.get();
+            s.nDispatchCount = m_histDispatch.count();
+            s.nDispatchP50Ns = m_histDispatch.percentile(50.0);
+            s.nDispatchP99Ns = m_histDispatch.percentile(99.0);
+            s.nDispatchMaxNs = m_histDispatch.max();
+        }
+
+    private:
+        // Written on the read path
+        metrics_counter m_nMessagesIn;
+        metrics_counter m_nBytesIn;
+        // Written on the write path
+        metrics_counter m_nMessagesOut;
+        metrics_counter m_nBytesOut;
+        metrics_counter m_nQueueDepth;
+        metrics_counter m_nHandshakeNs;
+        // Written just before OnMessage, by the thread calling Update() or a handler
+        // thread. Coarse buckets keep it small, the server wide histogram has the fine
+        // grained picture.
+        latency_histogram<4> m_histDispatch;
+};
+
+// Metrics compiled out, everything is a no-op
+template<>
+class basic_connection_metrics<false>{
+    public:
+        static constexpr bool bEnabled = false;
+
+        static uint64_t Now() { return 0; }
+        void MessageIn(size_t) {}
+        void MessagesOut(size_t, size_t) {}
+        void QueueDepth(size_t) {}
+        void Handshake(uint64_t) {}
+        void Dispatch(uint64_t) {}
+        void Fill(connection_metrics_snapshot&) const {}
+};
+
+using connection_metrics = basic_connection_metrics<NET_METRICS_ENABLED>;
+
+// Point in time copy of the whole server's metrics
+struct server_metrics_snapshot{
+    uint64_t nConnections = 0;
+    uint64_t nAccepted = 0;
+    uint64_t nRejected = 0;
+
+    // Totals over every connection, including the ones already gone
+    uint64_t nMessagesIn = 0;
+    uint64_t nMessagesOut = 0;
+    uint64_t nBytesIn = 0;
+    uint64_t nBytesOut = 0;
+    uint64_t nDropped = 0;
+
+    // Totals over the current connections only
+    uint64_t nQueueDepth = 0;
+    uint64_t nQueuedBytes = 0;
+
+    latency_histogram<> histDispatch;
+    latency_histogram<> histHandshake;
+
+    // Empty unless asked for
+    std::vector<connection_metrics_snapshot> vConnections;
+
+    // Count one connection in the totals
+    void Accumulate(const connection_metrics_snapshot& c, bool bLive){
+        nMessagesIn += c.nMessagesIn;
+        nMessagesOut += c.nMessagesOut;
+        nBytesIn += c.nBytesIn;
+        nBytesOut += c.nBytesOut;
+        nDropped += c.nDropped;
+        if (bLive){
+            nConnections++;
+            nQueueDepth += c.nQueueDepth;
+            nQueuedBytes += c.nQueuedBytes;
+        }
+    }
+
+    // Plain text report, busiest connections first
+    friend std::ostream& operator << (std::ostream& os, const server_metrics_snapshot& s){
+        os << "connections " << s.nConnections << " accepted " << s.nAccepted << " rejected " << s.nRejected << "\n";
+        os << "messages in " << s.nMessagesIn << " out " << s.nMessagesOut
+           << " bytes in " << s.nBytesIn << " out " << s.nBytesOut
+           << " queued " << s.nQueueDepth << " (" << s.nQueuedBytes << " bytes) dropped " << s.nDropped << "\n";
+
+        auto latency = [&os](const char* sName, const latency_histogram<>& hist){
+            os << sName << " us: count " << hist.count()
+               << " p50 " << hist.percentile(50.0) / 1000.0 << " p99 " << hist.percentile(99.0) / 1000.0
+               << " p999 " << hist.percentile(99.9) / 1000.0 << " max " << hist.max() / 1000.0 << "\n";
+        };
+        latency("dispatch", s.histDispatch);
+        latency("handshake", s.histHandshake);
+
+        if (!s.vConnections.empty()){
+            std::vector<const connection_metrics_snapshot*> vSorted;
+            for (const auto& c : s.vConnections)
+                vSorted.push_back(&c);
+            std::sort(vSorted.begin(), vSorted.end(), [](auto a, auto b){
+                return a->nBytesIn + a->nBytesOut > b->nBytesIn + b->nBytesOut;
+            });
+
+            os << "id msgs_in msgs_out bytes_in bytes_out queue queued_bytes dropped handshake_us dispatch_p50_us dispatch_p99_us\n";
+            for (const auto* c : vSorted){
+                os << c->nID << " " << c->nMessagesIn << " " << c->nMessagesOut << " " << c->nBytesIn << " " << c->nBytesOut
+                   << " " << c->nQueueDepth << " " << c->nQueuedBytes << " " << c->nDropped
+                   << " " << c->nHandshakeNs / 1000.0 << " " << c->nDispatchP50Ns / 1000.0 << " " << c->nDispatchP99Ns / 1000.0 << "\n";
+            }
+        }
+        return os;
+    }
+};
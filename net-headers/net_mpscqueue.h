@@ -0,0 +1,214 @@
+#pragma once
+#include "net_common.h"
+#include "net_tsqueue.h"
+
+// Lock-free multi-producer / single-consumer queue. Any number of threads may push,
+// but only one thread may consume (empty, front, pop_front, drain, wait).
+// Producers push onto an atomic stack with a single CAS. The consumer takes the whole
+// stack with one atomic exchange, puts it back in arrival order, and then serves items
+// from that private list without further synchronisation - so draining hundreds of
+// messages costs one atomic operation rather than a lock per message.
+template<typename T>
+class mpsc_queue{
+    public:
+        mpsc_queue() = default;
+        mpsc_queue(const mpsc_queue<T>&) = delete;
+        virtual ~mpsc_queue() { clear(); }
+
+    public:
+        // Adds a copy of an item to back of the Queue
+        void push_back(const T& item){
+            emplace_back(item);
+        }
+
+        // Moves an item to back of the Queue
+        void push_back(T&& item){
+            emplace_back(std::move(item));
+        }
+
+        // Constructs an item in place at back of the Queue. Safe from any thread.
+        template<typename... Args>
+        void emplace_back(Args&&... args){
+            node* pNode = new node{ T{ std::forward<Args>(args)... }, nullptr };
+
+            pNode->pNext = m_pIncoming.load(std::memory_order_relaxed);
+            while (!m_pIncoming.compare_exchange_weak(pNode->pNext, pNode,
+                std::memory_order_seq_cst, std::memory_order_relaxed));
+
+            m_nCount.fetch_add(1, std::memory_order_relaxed);
+
+            // Only pay for the mutex when the consumer is actually asleep
+            if (m_nWaiters.load(std::memory_order_seq_cst) > 0){
+                std::unique_lock<std::mutex> ul(muxBlocking);
+                cvBlocking.notify_one();
+            }
+            if (m_pSignal)
+                m_pSignal->notify();
+        }
+
+        // Returns and maintains item at front of Queue. Consumer only.
+        T& front(){
+            Collect();
+            return m_pHead->item;
+        }
+
+        // Removes and returns item at front of Queue. Consumer only.
+        T pop_front(){
+            Collect();
+            node* pNode = m_pHead;
+            m_pHead = pNode->pNext;
+            if (!m_pHead)
+                m_pTail = nullptr;
+
+            T t = std::move(pNode->item);
+            delete pNode;
+            m_nCount.fetch_sub(1, std::memory_order_relaxed);
+            return t;
+        }
+
+        // Moves up to nMax items, oldest first, onto the back of deqOut.
+        // Returns how many were moved. Consumer only.
+        size_t drain(std::deque<T>& deqOut, size_t nMax = size_t(-1)){
+            Collect();
+            size_t nMoved = 0;
+            while (m_pHead && nMoved < nMax){
+                node* pNode = m_pHead;
+                m_pHead = pNode->pNext;
+                deqOut.push_back(std::move(pNode->item));
+                delete pNode;
+                nMoved++;
+            }
+            if (!m_pHead)
+                m_pTail = nullptr;
+
+            m_nCount.fetch_sub(nMoved, std::memory_order_relaxed);
+            return nMoved;
+        }
+
+        // Returns true if Queue has no items. Exact on the consumer thread.
+        bool empty(){
+            return m_pHead == nullptr && m_pIncoming.load(std::memory_order_acquire) == nullptr;
+        }
+
+        // Returns number of items in Queue. Approximate while producers are pushing.
+        size_t count(){
+            return m_nCount.load(std::memory_order_relaxed);
+        }
+
+        // Clears Queue. Consumer only.
+        void clear(){
+            Collect();
+            while (m_pHead){
+                node* pNode = m_pHead;
+                m_pHead = pNode->pNext;
+                delete pNode;
+            }
+            m_pTail = nullptr;
+            m_nCount.store(0, std::memory_order_relaxed);
+        }
+
+        // Also notify pSignal whenever an item is pushed. Must be set before
+        // any producer starts pushing.
+        void attach(queue_signal* pSignal){
+            m_pSignal = pSignal;
+        }
+
+        // Blocks the consumer until the Queue has at least one item
+        void wait(){
+            Sleep([this](std::unique_lock<std::mutex>& ul){
+                cvBlocking.wait(ul, [this]{ return !empty(); });
+                return true;
+            });
+        }
+
+        // Blocks the consumer until the Queue has at least one item or the timeout
+        // expires. Returns true if the Queue has items.
+        template<typename Rep, typename Period>
+        bool wait_for(const std::chrono::duration<Rep, Period>& timeout){
+            return Sleep([&](std::unique_lock<std::mutex>& ul){
+                return cvBlocking.wait_for(ul, timeout, [this]{ return !empty(); });
+            });
+        }
+
+        // Blocks the consumer until the Queue has at least one item or the deadline
+        // passes. Returns true if the Queue has items.
+        template<typename Clock, typename Duration>
+        bool wait_until(const std::chrono::time_point<Clock, Duration>& deadline){
+            return Sleep([&](std::unique_lock<std::mutex>& ul){
+                return cvBlocking.wait_until(ul, deadline, [this]{ return !empty(); });
+            });
+        }
+
+        // Waits up to timeout for items, then moves up to nMax of them onto deqOut.
+        // Returns how many items were moved, 0 on timeout.
+        template<typename Rep, typename Period>
+        size_t pop_batch_wait(std::deque<T>& deqOut, size_t nMax, const std::chrono::duration<Rep, Period>& timeout){
+            if (!wait_for(timeout))
+                return 0;
+            return drain(deqOut, nMax);
+        }
+
+    private:
+        // Registers the consumer as a waiter and runs fnWait under the blocking mutex.
+        // Producers check for waiters after publishing, so either the producer sees the
+        // waiter and notifies, or the waiter's predicate sees the new item.
+        template<typename Func>
+        bool Sleep(Func fnWait){
+            if (!empty())
+                return true;
+
+            m_nWaiters.fetch_add(1, std::memory_order_seq_cst);
+            bool bReady;
+            {
+                std::unique_lock<std::mutex> ul(muxBlocking);
+                bReady = fnWait(ul);
+            }
+            m_nWaiters.fetch_sub(1, std::memory_order_relaxed);
+            return bReady;
+        }
+
+        struct node{
+            T item;
+            node* pNext;
+        };
+
+        // Move everything the producers have pushed onto the end of the consumer list.
+        // The producer stack is newest first, so it is reversed on the way.
+        void Collect(){
+            node* pStack = m_pIncoming.exchange(nullptr, std::memory_order_acquire);
+            if (!pStack)
+                return;
+
+            node* pFirst = nullptr;
+            node* pLast = pStack;
+            while (pStack){
+                node* pNext = pStack->pNext;
+                pStack->pNext = pFirst;
+                pFirst = pStack;
+                pStack = pNext;
+            }
+
+            if (m_pTail)
+                m_pTail->pNext = pFirst;
+            else
+                m_pHead = pFirst;
+            m_pTail = pLast;
+        }
+
+    protected:
+        // Shared with producers
+        std::atomic<node*> m_pIncoming{ nullptr };
+        std::atomic<size_t> m_nCount{ 0 };
+        std::atomic<int> m_nWaiters{ 0 };
+
+        // Owned by the consumer
+        node* m_pHead = nullptr;
+        node* m_pTail = nullptr;
+
+        // Only used to put the consumer to sleep when the Queue is empty
+        std::condition_variable cvBlocking;
+        std::mutex muxBlocking;
+
+        // Optional signal shared with other queues
+        queue_signal* m_pSignal = nullptr;
+};
@@ -0,0 +1,128 @@
+#pragma once
+#include "net_common.h"
+
+template <typename T>
+class connection;
+
+// Slot map holding the connections of one server shard, keyed by client ID.
+// A client ID packs the slot index, the owning shard and a generation counter, so
+// lookup and removal are O(1) and an ID belonging to a client that has since gone
+// (and whose slot was reused) is simply not found. The connections themselves are
+// kept in a dense array in no particular order, which is what broadcasts iterate.
+//
+//   bits  0..17  slot index
+//   bits 18..23  shard index
+//   bits 24..31  generation, never 0, so no valid ID is ever 0
+template <typename T>
+class connection_registry{
+    public:
+        static constexpr uint32_t nSlotBits = 18;
+        static constexpr uint32_t nShardBits = 6;
+        static constexpr uint32_t nGenerationBits = 8;
+
+        static constexpr uint32_t nMaxSlots = 1u << nSlotBits;
+        static constexpr uint32_t nMaxShards = 1u << nShardBits;
+
+        connection_registry(uint32_t nShard) : m_nShard(nShard){}
+
+        // Which shard a client ID belongs to
+        static uint32_t ShardOf(uint32_t id){
+            return (id >> nSlotBits) & (nMaxShards - 1);
+        }
+
+    public:
+        // Adds a connection and returns its new ID, or 0 if the registry is full
+        uint32_t insert(std::shared_ptr<connection<T>> conn){
+            uint32_t nSlot;
+            if (!m_deqFree.empty()){
+                // Reuse the slot freed longest ago, so a stale ID has to survive a
+                // full generation cycle of that slot before it could match again
+                nSlot = m_deqFree.front();
+                m_deqFree.pop_front();
+            }
+            else if (m_vSlots.size() < nMaxSlots){
+                nSlot = uint32_t(m_vSlots.size());
+                m_vSlots.push_back({ 1, nFreeSlot });
+            }
+            else{
+                return 0;
+            }
+
+            m_vSlots[nSlot].nDense = uint32_t(m_vDense.size());
+            m_vDense.push_back(std::move(conn));
+            m_vDenseSlot.push_back(nSlot);
+            return MakeID(nSlot);
+        }
+
+        // Returns the connection with this ID, or nullptr
+        std::shared_ptr<connection<T>> find(uint32_t id) const{
+            uint32_t nSlot = SlotOf(id);
+            if (!Valid(id, nSlot))
+                return nullptr;
+            return m_vDense[m_vSlots[nSlot].nDense];
+        }
+
+        // Removes the connection with this ID. The last dense entry is moved into
+        // the hole, so the order of the other connections may change.
+        bool erase(uint32_t id){
+            uint32_t nSlot = SlotOf(id);
+            if (!Valid(id, nSlot))
+                return false;
+
+            uint32_t nDense = m_vSlots[nSlot].nDense;
+            uint32_t nLast = uint32_t(m_vDense.size() - 1);
+            if (nDense != nLast){
+                m_vDense[nDense] = std::move(m_vDense[nLast]);
+                m_vDenseSlot[nDense] = m_vDenseSlot[nLast];
+                m_vSlots[m_vDenseSlot[nDense]].nDense = nDense;
+            }
+            m_vDense.pop_back();
+            m_vDenseSlot.pop_back();
+
+            // Bump the generation so the old ID no longer matches, skipping 0
+            uint32_t& nGeneration = m_vSlots[nSlot].nGeneration;
+            nGeneration = (nGeneration + 1) & ((1u << nGenerationBits) - 1);
+            if (nGeneration == 0)
+                nGeneration = 1;
+
+            m_vSlots[nSlot].nDense = nFreeSlot;
+            m_deqFree.push_back(nSlot);
+            return true;
+        }
+
+        size_t size() const { return m_vDense.size(); }
+        bool empty() const { return m_vDense.empty(); }
+
+        // Dense storage, for iterating every connection
+        std::shared_ptr<connection<T>>& operator[](size_t i) { return m_vDense[i]; }
+        auto begin() { return m_vDense.begin(); }
+        auto end() { return m_vDense.end(); }
+
+    private:
+        // nDense is the index into the dense arrays, or nFreeSlot when unused
+        static constexpr uint32_t nFreeSlot = 0xFFFFFFFF;
+
+        struct slot{
+            uint32_t nGeneration;
+            uint32_t nDense;
+        };
+
+        static uint32_t SlotOf(uint32_t id){
+            return id & (nMaxSlots - 1);
+        }
+
+        uint32_t MakeID(uint32_t nSlot) const{
+            return (m_vSlots[nSlot].nGeneration << (nSlotBits + nShardBits)) | (m_nShard << nSlotBits) | nSlot;
+        }
+
+        bool Valid(uint32_t id, uint32_t nSlot) const{
+            return nSlot < m_vSlots.size() && m_vSlots[nSlot].nDense != nFreeSlot && MakeID(nSlot) == id;
+        }
+
+    private:
+        uint32_t m_nShard = 0;
+        std::vector<slot> m_vSlots;
+        std::vector<std::shared_ptr<connection<T>>> m_vDense;
+        std::vector<uint32_t> m_vDenseSlot;
+        std::deque<uint32_t> m_deqFree;
+};
@@ -0,0 +1,130 @@
+#pragma once
+#include "net_common.h"
+#include "net_message.h"
+#include "net_log.h"
+#include "net_timer_wheel.h"
+#include <future>
+#include <stdexcept>
+#include <unordered_map>
+
+// Thrown (or stored in the future) when a request gets no response
+struct request_error : public std::runtime_error{
+    using std::runtime_error::runtime_error;
+};
+
+// A request waiting for its response, or for its deadline on the client's timer
+// wheel, whichever comes first. Either way finish() wakes whoever waits for it, and
+// they find out which by looking at reply.
+template <typename T>
+struct pending_request{
+    // wake never expires by itself, it is only ever cancelled by finish()
+    pending_request(asio::io_context& context) : wake(context, asio::steady_timer::time_point::max()){}
+
+    wheel_timer deadline;
+    std::optional<message<T>> reply;
+    // Set when the connection gave up on the request before the deadline
+    bool bCancelled = false;
+    bool bFinished = false;
+
+    // Requests waited on by a coroutine
+    asio::steady_timer wake;
+
+    // Requests waited on through a future
+    bool bFuture = false;
+    std::promise<message<T>> promise;
+
+    // Wake the waiter, once
+    void finish(){
+        if (bFinished)
+            return;
+        bFinished = true;
+
+        if (!bFuture)
+            wake.cancel();
+        else if (reply)
+            promise.set_value(std::move(*reply));
+        else
+            promise.set_exception(std::make_exception_ptr(request_error(bCancelled ? "request cancelled" : "request timed out")));
+    }
+};
+
+// Requests of one client that are waiting for their response, keyed by the correlation
+// id in the message header. Requests may be added from any thread, responses are
+// matched on the io thread as they arrive, so any number of requests can be in flight
+// on the one connection and their responses may come back in any order.
+template <typename T>
+class request_table{
+    public:
+        // Give the request a correlation id and start tracking it
+        uint32_t add(std::shared_ptr<pending_request<T>> pRequest){
+            std::scoped_lock lock(m_muxRequests);
+            uint32_t nID;
+            do{
+                nID = ++m_nLastID;
+            } while (nID == 0 || m_mapRequests.count(nID) > 0);
+            m_mapRequests.emplace(nID, std::move(pRequest));
+            return nID;
+        }
+
+        // Stop tracking a request, returns nullptr if it was not tracked any more
+        std::shared_ptr<pending_request<T>> take(uint32_t nID){
+            std::scoped_lock lock(m_muxRequests);
+            auto it = m_mapRequests.find(nID);
+            if (it == m_mapRequests.end())
+                return nullptr;
+            std::shared_ptr<pending_request<T>> pRequest = std::move(it->second);
+            m_mapRequests.erase(it);
+            return pRequest;
+        }
+
+        // io thread: if msg answers a request, hand it over and return true. Responses to
+        // requests that have already timed out are consumed as well, and dropped.
+        bool complete(message<T>& msg){
+            if (msg.header.correlation == 0)
+                return false;
+
+            std::shared_ptr<pending_request<T>> pRequest = take(msg.header.correlation);
+            if (!pRequest){
+                NET_LOG_DEBUG("[----] Late response " << msg.header.correlation << " dropped.");
+                return true;
+            }
+
+            pRequest->deadline.cancel();
+            pRequest->reply = std::move(msg);
+            pRequest->finish();
+            return true;
+        }
+
+        // io thread: the request's deadline passed
+        void expire(uint32_t nID){
+            if (std::shared_ptr<pending_request<T>> pRequest = take(nID))
+                pRequest->finish();
+        }
+
+        // Give up on every request. Only call while the io thread is not running: futures
+        // fail right here, coroutines waiting on a request are destroyed along with the
+        // context.
+        void cancel_all(){
+            std::unordered_map<uint32_t, std::shared_ptr<pending_request<T>>> mapRequests;
+            {
+                std::scoped_lock lock(m_muxRequests);
+                mapRequests.swap(m_mapRequests);
+            }
+            for (auto& [nID, pRequest] : mapRequests){
+                pRequest->deadline.cancel();
+                pRequest->bCancelled = true;
+                if (pRequest->bFuture)
+                    pRequest->finish();
+            }
+        }
+
+        size_t size(){
+            std::scoped_lock lock(m_muxRequests);
+            return m_mapRequests.size();
+        }
+
+    private:
+        std::mutex m_muxRequests;
+        std::unordered_map<uint32_t, std::shared_ptr<pending_request<T>>> m_mapRequests;
+        uint32_t m_nLastID = 0;
+};
@@ -0,0 +1,136 @@
+#pragma once
+#include "net_common.h"
+#include "net_message.h"
+#include "net_message_view.h"
+
+// Compile time message schema. Every message id is bound to the payload type it
+// carries, once, in a header shared by both ends:
+//   NET_MESSAGE_PAYLOAD(MyMsgTypes::NewGoal, GoalPayload);
+// make_message<Id>() and read_payload<Id>() then check the payload type at compile
+// time and move a fixed size payload in and out with a single memcpy, and
+// message_dispatch calls a typed handler for each id through a jump table.
+
+// Payload of messages that carry nothing but their id
+struct no_payload{};
+
+// Payload of variable length messages, handed to their handler as a message_view
+struct variable_payload{};
+
+// Payload type bound to a message id, void if the id is not in the schema
+template<auto Id>
+struct message_payload{
+    using type = void;
+};
+
+template<auto Id>
+using message_payload_t = typename message_payload<Id>::type;
+
+#define NET_MESSAGE_PAYLOAD(ID, TYPE) \
+    template<> \
+    struct message_payload<ID>{ \
+        static_assert(std::is_trivially_copyable<TYPE>::value && std::is_standard_layout<TYPE>::value, \
+            "Payload must be trivially copyable"); \
+        using type = TYPE; \
+    }
+
+// Size of a fixed payload on the wire
+template<typename Payload>
+constexpr size_t payload_size = std::is_empty<Payload>::value ? 0 : sizeof(Payload);
+
+// Tag a handler overload is selected by, one type per message id
+template<auto Id>
+struct message_tag{
+    static constexpr auto id = Id;
+};
+
+// Build a message with a fixed size payload
+template<auto Id>
+message<decltype(Id)> make_message(const message_payload_t<Id>& payload = {}){
+    using Payload = message_payload_t<Id>;
+    static_assert(!std::is_void<Payload>::value, "Message id has no payload bound to it");
+    static_assert(!std::is_same<Payload, variable_payload>::value, "Variable length messages are built by hand");
+
+    message<decltype(Id)> msg;
+    msg.header.id = Id;
+    if constexpr (payload_size<Payload> > 0){
+        msg.body.resize(payload_size<Payload>);
+        std::memcpy(msg.body.data(), &payload, payload_size<Payload>);
+    }
+    msg.header.size = msg.size();
+    return msg;
+}
+
+// Read a fixed size payload. Returns false, leaving payload untouched, unless the
+// message is exactly the size of the payload.
+template<auto Id>
+bool read_payload(const message<decltype(Id)>& msg, message_payload_t<Id>& payload){
+    using Payload = message_payload_t<Id>;
+    static_assert(!std::is_void<Payload>::value, "Message id has no payload bound to it");
+    static_assert(!std::is_same<Payload, variable_payload>::value, "Variable length messages are read with a message_view");
+
+    if (msg.header.size != payload_size<Payload> || msg.body.size() != payload_size<Payload>)
+        return false;
+    if constexpr (payload_size<Payload> > 0)
+        std::memcpy(&payload, msg.body.data(), payload_size<Payload>);
+    return true;
+}
+
+enum class dispatch_result{
+    handled,
+    // No handler for the id
+    unknown_id,
+    // The message is not the size of its payload
+    bad_size
+};
+
+// Jump table from message id to typed handler, built at compile time for the ids
+// listed. Ids index the table directly, so they should be small and dense, as enum
+// values usually are.
+// dispatch(handler, msg, args...) decodes the payload and calls
+//   handler.OnPayload(message_tag<Id>{}, const Payload& payload, message<T>& msg, args...)
+// or, for variable_payload ids,
+//   handler.OnPayload(message_tag<Id>{}, message_view<T>& view, message<T>& msg, args...)
+template<typename T, T... Ids>
+class message_dispatch{
+    public:
+        static constexpr size_t nSize = std::max({ size_t(Ids)... }) + 1;
+
+        template<typename Handler, typename... Args>
+        static dispatch_result dispatch(Handler& handler, message<T>& msg, Args&&... args){
+            static constexpr std::array<entry<Handler, Args...>, nSize> aTable = Table<Handler, Args...>();
+
+            size_t nIndex = size_t(msg.header.id);
+            if (nIndex >= nSize || aTable[nIndex] == nullptr)
+                return dispatch_result::unknown_id;
+            return aTable[nIndex](handler, msg, std::forward<Args>(args)...);
+        }
+
+    private:
+        template<typename Handler, typename... Args>
+        using entry = dispatch_result (*)(Handler&, message<T>&, Args&&...);
+
+        template<typename Handler, typename... Args>
+        static constexpr std::array<entry<Handler, Args...>, nSize> Table(){
+            std::array<entry<Handler, Args...>, nSize> aTable{};
+            ((aTable[size_t(Ids)] = &Call<Ids, Handler, Args...>), ...);
+            return aTable;
+        }
+
+        template<T Id, typename Handler, typename... Args>
+        static dispatch_result Call(Handler& handler, message<T>& msg, Args&&... args){
+            using Payload = message_payload_t<Id>;
+            static_assert(!std::is_void<Payload>::value, "Message id has no payload bound to it");
+
+            if constexpr (std::is_same<Payload, variable_payload>::value){
+                message_view<T> view(msg);
+                handler.OnPayload(message_tag<Id>{}, view, msg, std::forward<Args>(args)...);
+            }
+            else{
+                Payload payload{};
+                if (!read_payload<Id>(msg, payload))
+                    return dispatch_result::bad_size;
+                handler.OnPayload(message_tag<Id>{}, static_cast<const Payload&>(payload), msg, std::forward<Args>(args)...);
+            }
+            return dispatch_result::handled;
+        }
+};
@@ -4,13 +4,56 @@
 #include "net_tsqueue.h"
 #include "net_message.h"
 #include "net_connection.h"
+#include "net_registry.h"
+#include "net_metrics.h"
+#include "net_log.h"
+#include "net_timer_wheel.h"
+#include "net_slab.h"
+#include "net_handler_pool.h"
+#include <fstream>
+#include <cstdio>
 
 template<typename T>
 class server_interface{
     public:
-        server_interface(uint16_t port)
-            : m_asioAcceptor(m_asioContext, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port)){
+        // How the server spreads its work over the io threads
+        enum class threading{
+            // One asio context run by every io thread, connections serialised by strands
+            pool,
+            // One asio context, acceptor, incoming queue and connection set per io
+            // thread. Connections never migrate between threads and the hot path
+            // takes no lock shared between threads.
+            sharded
+        };
 
+    public:
+        // nThreads is the number of io threads, 0 picks one per hardware thread. With more
+        // than one, OnClientValidated may be called concurrently for different clients.
+        server_interface(uint16_t port, size_t nThreads = 0, threading model = threading::pool){
+            m_nThreads = nThreads > 0 ? nThreads : std::max<size_t>(std::thread::hardware_concurrency(), 1);
+            m_nThreading = model;
+
+            // Client IDs have room for a limited number of shards
+            if (model == threading::sharded)
+                m_nThreads = std::min<size_t>(m_nThreads, connection_registry<T>::nMaxShards);
+
+            size_t nShards = (model == threading::sharded) ? m_nThreads : 1;
+            for (size_t i = 0; i < nShards; i++){
+                m_vShards.push_back(std::make_unique<shard>(model == threading::sharded ? 1 : int(m_nThreads), uint32_t(i)));
+                m_vShards.back()->qMessagesIn.attach(&m_signalMessagesIn);
+            }
+
+            asio::ip::tcp::endpoint endpoint(asio::ip::tcp::v4(), port);
+#ifdef SO_REUSEPORT
+            // Every shard listens on the same port, and the kernel spreads incoming
+            // connections across the acceptors
+            for (auto& s : m_vShards)
+                OpenAcceptor(s->acceptor, endpoint, nShards > 1);
+#else
+            // Without SO_REUSEPORT the first shard accepts for all of them, handing
+            // each new socket to the next shard in turn
+            OpenAcceptor(m_vShards.front()->acceptor, endpoint, false);
+#endif
         }
 
         virtual ~server_interface(){
@@ -19,110 +62,509 @@ class server_interface{
 
         bool Start(){
             try{
-                WaitForClientConnection();
+                for (size_t i = 0; i < m_vShards.size(); i++){
+                    if (m_vShards[i]->acceptor.is_open()){
+                        for (size_t k = 0; k < m_nAcceptsInFlight; k++)
+                            WaitForClientConnection(i);
+                    }
+                    m_vShards[i]->ticker.start();
+                }
                 
-                m_threadContext = std::thread([this]() { m_asioContext.run(); });
+                for (auto& s : m_vShards){
+                    size_t nThreads = (m_nThreading == threading::sharded) ? 1 : m_nThreads;
+                    for (size_t i = 0; i < nThreads; i++)
+                        s->vThreads.emplace_back([&context = s->context]() { context.run(); });
+                }
             }
             catch (std::exception& e){
                 // Something prohibited the server from listening
-                std::cerr << "[SERVER] exception: " << e.what() << std::endl;
+                NET_LOG_ERROR("[SERVER] exception: " << e.what());
                 return false;
             }
-            std::cout << "[SERVER] Started!\n";
+            NET_LOG_INFO("[SERVER] Started!");
 			return true;
         }
 
         void Stop(){
-            // Request the context to close the connection
-            m_asioContext.stop();
+            // Request the contexts to close the connection
+            for (auto& s : m_vShards)
+                s->context.stop();
 
-            // Tidy up the context thread
-            if(m_threadContext.joinable()) m_threadContext.join();
+            // Tidy up the context threads
+            for (auto& s : m_vShards){
+                for (auto& thread : s->vThreads)
+                    if(thread.joinable()) thread.join();
+                s->vThreads.clear();
+            }
+
+            StopHandlers();
+
+            // Stop the metrics dump, if one is running
+            std::thread thrMetricsDump;
+            {
+                std::scoped_lock lock(m_muxMetricsDump);
+                m_bStopMetricsDump = true;
+                thrMetricsDump = std::move(m_thrMetricsDump);
+            }
+            m_cvMetricsDump.notify_all();
+            if (thrMetricsDump.joinable())
+                thrMetricsDump.join();
 
             // Inform someone, if they care
-            std:: cout << "[SERVER] stopped!" << std::endl;
+            NET_LOG_INFO("[SERVER] stopped!");
         }
 
-        // ASYNC - Instruct asio to wait for connection
-        void WaitForClientConnection(){
-            m_asioAcceptor.async_accept(
-                [this](std::error_code ec, asio::ip::tcp::socket socket){
+        // ASYNC - Instruct asio to wait for connection on a shard's acceptor. Each call
+        // keeps one more accept outstanding on it, see SetAcceptsInFlight().
+        void WaitForClientConnection(size_t nShard = 0){
+            // Pick the shard the new connection will live on. With an acceptor per shard
+            // that is the accepting shard itself.
+            size_t nTarget = nShard;
+#ifndef SO_REUSEPORT
+            nTarget = m_nNextShard.fetch_add(1, std::memory_order_relaxed) % m_vShards.size();
+#endif
+            shard& target = *m_vShards[nTarget];
+
+            // Each accepted socket gets its own strand, which serialises the
+            // connection's handlers across the io thread pool
+            m_vShards[nShard]->acceptor.async_accept(asio::make_strand(target.context),
+                [this, nShard, &target](std::error_code ec, asio::ip::tcp::socket socket){
                     if(!ec){
-                        std::cout << "[SERVER] New connection: " << socket.remote_endpoint() << std::endl;
+                        NET_LOG_INFO("[SERVER] New connection: " << socket.remote_endpoint());
 
+                        // Connections come out of the shard's slab, so a flood of them
+                        // does not queue up on the heap
                         std::shared_ptr<connection<T>> newconn = 
-								std::make_shared<connection<T>>(connection<T>::owner::server, 
-									m_asioContext, std::move(socket), m_qMessagesIn);
+								std::allocate_shared<connection<T>>(slab_allocator<connection<T>>(target.pConnectionPool),
+									connection<T>::owner::server, target.context, std::move(socket), target.qMessagesIn);
+                        newconn->SetWriteLimits(m_nMaxWriteBytes, m_nMaxWriteBuffers);
+                        newconn->SetReadMode(m_nReadMode);
+                        newconn->SetSendLimits(m_sendLimits);
+                        newconn->SetTimeouts(m_timeouts, target.pWheel, m_pHeartbeat);
+
                         if(OnClientConnect(newconn)){
-                            // Connection allowed, so add to container of new connections
-                            m_deqConnections.push_back(std::move(newconn));
-                            m_deqConnections.back()->ConnectToClient(this, nIDCounter++);
-                            std::cout << "[" << m_deqConnections.back()->GetID() << "] Connection aproved!" << std::endl;
+                            // Connection allowed, so add to the registry of connections,
+                            // which hands out its ID
+                            std::scoped_lock lock(target.muxConnections);
+                            uint32_t nID = target.registry.insert(newconn);
+                            if (nID != 0){
+                                newconn->ConnectToClient(this, nID);
+                                target.nAccepted.add(1);
+                                NET_LOG_INFO("[" << nID << "] Connection aproved!");
+                            }
+                            else{
+                                target.nRejected.add(1);
+                                NET_LOG_WARN("[----] Connection denied (server full)");
+                            }
                         }
                         else{
-                            std::cout<< "[----] Connection denied" << std::endl;
+                            std::scoped_lock lock(target.muxConnections);
+                            target.nRejected.add(1);
+                            NET_LOG_INFO("[----] Connection denied");
                         }
                     }
                     else{
                         // Error has occurred during acceptance
-                        std::cout << "[SERVER] New connection error: " << ec.message() << std::endl;
+                        NET_LOG_ERROR("[SERVER] New connection error: " << ec.message());
                     }
 
-                    WaitForClientConnection();
+                    WaitForClientConnection(nShard);
                 });
         }
 
+        // Number of accepts kept outstanding on each acceptor. When a crowd of clients
+        // connects at once, as after a server restart, asio completes one accept for
+        // each of them per wake up instead of one accept per round through the context,
+        // and in pool mode several io threads set connections up side by side.
+        // Must be called before Start().
+        void SetAcceptsInFlight(size_t nAccepts){
+            m_nAcceptsInFlight = std::max<size_t>(nAccepts, 1);
+        }
+
+        // Number of connections each shard keeps memory ready for, carved in one block
+        // when the shard accepts its first client. Beyond that connections are
+        // allocated one by one. Must be called before Start().
+        void SetConnectionPool(size_t nConnections){
+            for (auto& s : m_vShards)
+                s->pConnectionPool = std::make_shared<slab_pool>(nConnections);
+        }
+
+        // Run OnMessage on a pool of nThreads handler threads instead of the thread
+        // calling Update(), which then only hands messages over. Each client is hashed
+        // to one of nLanes serial lanes, so the messages of a client are still handled
+        // one at a time and in order, but OnMessage may be called concurrently for
+        // different clients. 0 picks one thread per hardware thread and 16 lanes per
+        // thread. Must be called before Start().
+        // The handler threads call into the derived server, so a server using them must
+        // call Stop() or StopHandlers() in its own destructor: by the time the base
+        // destructor stops them the derived members OnMessage uses are gone.
+        void SetHandlerThreads(size_t nThreads, size_t nLanes = 0){
+            m_pHandlers = std::make_unique<handler_pool<owned_message<T>>>(nThreads, nLanes,
+                [this](owned_message<T>& msg){ HandleMessage(msg); });
+        }
+
+        // Let the handlers running finish and stop the handler threads. Messages handed
+        // over and not yet handled are dropped. Called by Stop().
+        void StopHandlers(){
+            if (m_pHandlers)
+                m_pHandlers->stop();
+        }
+
+        // Messages handed to the handler threads and not yet handled
+        size_t HandlerBacklog() const{
+            return m_pHandlers ? m_pHandlers->pending() : 0;
+        }
+
+        // Limit how many queued bytes/buffers each connection gathers into one write.
+        // Applies to connections accepted after the call.
+        void SetWriteLimits(size_t nMaxBytes, size_t nMaxBuffers){
+            m_nMaxWriteBytes = nMaxBytes;
+            m_nMaxWriteBuffers = nMaxBuffers;
+        }
+
+        // Select how connections read incoming messages. Applies to connections
+        // accepted after the call.
+        void SetReadMode(typename connection<T>::read_mode mode){
+            m_nReadMode = mode;
+        }
+
+        // Bound the outgoing queue of every client, so a slow or stalled client cannot
+        // make the server buffer without limit. Applies to connections accepted after the call.
+        void SetSendLimits(const typename connection<T>::send_limits& limits){
+            m_sendLimits = limits;
+        }
+
+        // Drop clients that do not validate in time or go quiet, and keep quiet clients
+        // hearing from the server. heartbeat is the message sent when a client has been
+        // sent nothing for timeouts.heartbeat, without one no heartbeats are sent.
+        // Applies to connections accepted after the call.
+        void SetTimeouts(const typename connection<T>::timeouts& limits, std::optional<message<T>> heartbeat = std::nullopt){
+            m_timeouts = limits;
+            m_pHeartbeat.reset();
+            if (heartbeat)
+                m_pHeartbeat = std::make_shared<const message<T>>(std::move(*heartbeat));
+        }
+
         // Send a message to a specific client
         void MessageClient(std::shared_ptr<connection<T>> client, const message<T>& msg){
-            if(client && client->IsConnected()){
-                client->Send(msg);
+            MessageClient(std::move(client), message<T>(msg));
+        }
+
+        // Send a message to a specific client, moving it into the client's outgoing queue
+        void MessageClient(std::shared_ptr<connection<T>> client, message<T>&& msg){
+            if (!client)
+                return;
+
+            if(client->IsConnected()){
+                client->Send(std::move(msg));
+                return;
             }
-            else{
-                OnClientDisconnect(client);
-                client.reset();
-                m_deqConnections.erase(std::remove(m_deqConnections.begin(), m_deqConnections.end(), client), m_deqConnections.end());                
+
+            // Only whoever takes the client out of the registry tells the application,
+            // it may already have gone through MessageAllClients() or a timeout
+            bool bErased = false;
+            {
+                shard& s = *m_vShards[connection_registry<T>::ShardOf(client->GetID())];
+                std::scoped_lock lock(s.muxConnections);
+                bErased = s.registry.erase(client->GetID());
+                if (bErased)
+                    RetireMetrics(*client);
             }
+
+            // Tell the application outside the registry lock, so it is free to
+            // message other clients from the callback
+            if (bErased)
+                OnClientDisconnect(client);
+        }
+
+        // Send a message to the client with this ID, if it is still connected
+        void MessageClient(uint32_t nClientID, message<T>&& msg){
+            if (std::shared_ptr<connection<T>> client = GetClient(nClientID))
+                MessageClient(std::move(client), std::move(msg));
+        }
+
+        // Look a client up by its ID, returns nullptr if there is no such client
+        std::shared_ptr<connection<T>> GetClient(uint32_t nClientID){
+            uint32_t nShard = connection_registry<T>::ShardOf(nClientID);
+            if (nShard >= m_vShards.size())
+                return nullptr;
+
+            std::scoped_lock lock(m_vShards[nShard]->muxConnections);
+            return m_vShards[nShard]->registry.find(nClientID);
         }
 
-        // Send a message to all clients
+        // Send a message to all clients. The message is copied once into a shared,
+        // immutable frame, and every client queues a pointer to that frame.
         void MessageAllClients(const message<T>& msg, std::shared_ptr<connection<T>> pIgnoreClient = nullptr){
+            MessageAllClients(std::make_shared<const message<T>>(msg), std::move(pIgnoreClient));
+        }
+
+        // Send a message to all clients, moving it into the shared frame
+        void MessageAllClients(message<T>&& msg, std::shared_ptr<connection<T>> pIgnoreClient = nullptr){
+            MessageAllClients(std::make_shared<const message<T>>(std::move(msg)), std::move(pIgnoreClient));
+        }
 
-            bool bInvalidClientExists = false;
+        // Send an already shared message to all clients, shard by shard
+        void MessageAllClients(std::shared_ptr<const message<T>> msg, std::shared_ptr<connection<T>> pIgnoreClient = nullptr){
 
-            for (auto& client : m_deqConnections){
-                //Check client is connected
-                if(client and client->IsConnected()){
-                    // it is
-                    if(client != pIgnoreClient)
-                        client->Send(msg);
-                }
-                else{
-                    OnClientDisconnect(client);
-                    client.reset();
-                    bInvalidClientExists = true;
+            std::vector<std::shared_ptr<connection<T>>> vDeadClients;
+
+            for (auto& s : m_vShards){
+                std::scoped_lock lock(s->muxConnections);
+
+                // Walk the dense array backwards, so removing a dead client (which
+                // moves the last entry into its place) never skips anyone
+                for (size_t i = s->registry.size(); i-- > 0; ){
+                    std::shared_ptr<connection<T>>& client = s->registry[i];
+                    //Check client is connected
+                    if(client->IsConnected()){
+                        // it is
+                        if(client != pIgnoreClient)
+                            client->Send(msg);
+                    }
+                    else{
+                        vDeadClients.push_back(client);
+                        s->registry.erase(vDeadClients.back()->GetID());
+                        RetireMetrics(*vDeadClients.back());
+                    }
                 }
             }
 
-            if(bInvalidClientExists){
-                m_deqConnections.erase(std::remove(m_deqConnections.begin(), m_deqConnections.end(), nullptr), m_deqConnections.end());    
-            }
+            // Tell the application outside the registry locks, so it is free to
+            // message other clients from the callback
+            for (auto& client : vDeadClients)
+                OnClientDisconnect(client);
         }
 
         void Update(size_t nMaxMessages = -1, bool bWait = false){
 
             if(bWait){
-                m_qMessagesIn.wait();
+                m_signalMessagesIn.wait([this]{ return HasMessages(); });
+            }
+            DispatchMessages(nMaxMessages);
+        }
+
+        // Like Update(nMaxMessages, true), but gives up waiting for the first message
+        // after timeout. Returns the number of messages handled.
+        template<typename Rep, typename Period>
+        size_t UpdateFor(size_t nMaxMessages, const std::chrono::duration<Rep, Period>& timeout){
+            if(!m_signalMessagesIn.wait_for([this]{ return HasMessages(); }, timeout)){
+                return 0;
+            }
+            return DispatchMessages(nMaxMessages);
+        }
+
+        // Handle queued messages until none are left or tDeadline passes, whichever comes
+        // first, so a game loop or the like can give Update() a slice of each frame.
+        // Messages drained but not handled in time stay first in line for the next call.
+        // With bWait, waits until tDeadline for the first message. Returns the number
+        // of messages handled.
+        size_t UpdateUntil(std::chrono::steady_clock::time_point tDeadline, bool bWait = false){
+            if(bWait && !m_signalMessagesIn.wait_for([this]{ return HasMessages(); }, tDeadline - std::chrono::steady_clock::now())){
+                return 0;
+            }
+            return DispatchMessages(size_t(-1), tDeadline);
+        }
+
+        // Point in time copy of the server's metrics. bPerConnection adds a snapshot
+        // of every current connection, which briefly locks each shard's registry.
+        server_metrics_snapshot GetMetrics(bool bPerConnection = true){
+            server_metrics_snapshot s;
+            {
+                std::scoped_lock lock(m_muxMetrics);
+                s = m_metricsRetired;
             }
+            s.histDispatch = m_histDispatch;
+            s.histHandshake = m_histHandshake;
+
+            for (auto& sh : m_vShards){
+                s.nAccepted += sh->nAccepted.get();
+                s.nRejected += sh->nRejected.get();
+
+                std::scoped_lock lock(sh->muxConnections);
+                for (auto& client : sh->registry){
+                    connection_metrics_snapshot c = client->GetMetrics();
+                    s.Accumulate(c, true);
+                    if (bPerConnection)
+                        s.vConnections.push_back(c);
+                }
+            }
+            return s;
+        }
+
+        // Write the metrics report to sFile every interval, replacing the previous one,
+        // until the server stops. The file is written aside and renamed over the old one,
+        // so a reader never sees half a report. Reports are built and written on a thread
+        // of their own, never holding up the io threads. Returns false if a dump is
+        // already running.
+        bool StartMetricsDump(const std::string& sFile, std::chrono::milliseconds interval){
+            std::scoped_lock lock(m_muxMetricsDump);
+            if (m_thrMetricsDump.joinable())
+                return false;
+
+            m_bStopMetricsDump = false;
+            m_thrMetricsDump = std::thread([this, sFile, interval](){ DumpMetrics(sFile, interval); });
+            return true;
+        }
+
+        // Called on an io thread by a connection that gave up on its client, to take it
+        // out of the registry straight away
+        void ReleaseClient(std::shared_ptr<connection<T>> client){
+            shard& s = *m_vShards[connection_registry<T>::ShardOf(client->GetID())];
+            bool bErased = false;
+            {
+                std::scoped_lock lock(s.muxConnections);
+                bErased = s.registry.erase(client->GetID());
+            }
+            if (bErased){
+                RetireMetrics(*client);
+                OnClientDisconnect(client);
+            }
+        }
+
+        // Called by a connection when its client passes validation
+        void RecordHandshake(uint64_t nNs){
+            if constexpr (connection_metrics::bEnabled)
+                m_histHandshake.record(nNs);
+        }
+
+    private:
+        // Everything one io_context needs to serve its share of the connections
+        struct shard{
+            shard(int nConcurrency, uint32_t nIndex)
+                : context(nConcurrency), pWheel(std::make_shared<timer_wheel>()), ticker(context, pWheel),
+                  pConnectionPool(std::make_shared<slab_pool>(nPooledConnections)), registry(nIndex), acceptor(context){}
+
+            // Order of declaration is important - it is also the order of initialization,
+            // and the reverse of destruction. The context must outlive every socket.
+            asio::io_context context;
+
+            // Deadlines of this shard's connections. The connections share ownership of
+            // the wheel, so it outlives every timer on it.
+            std::shared_ptr<timer_wheel> pWheel;
+            wheel_ticker ticker;
+
+            // Memory for this shard's connections, shared by the connections as well
+            std::shared_ptr<slab_pool> pConnectionPool;
+
+            // Thred safe queue for incoming message packets from this shard's connections
+            incoming_queue<T> qMessagesIn;
+
+            // Registry of active connections, keyed by client ID. Locked only when
+            // connections are added, looked up or removed and for broadcasts, never
+            // on the read/write path.
+            std::mutex muxConnections;
+            connection_registry<T> registry;
+
+            asio::ip::tcp::acceptor acceptor;
+            std::vector<std::thread> vThreads;
+
+            // Written by the accept handlers, under muxConnections
+            metrics_counter nAccepted;
+            metrics_counter nRejected;
+        };
+
+        static void OpenAcceptor(asio::ip::tcp::acceptor& acceptor, const asio::ip::tcp::endpoint& endpoint, bool bReusePort){
+            acceptor.open(endpoint.protocol());
+            acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+#ifdef SO_REUSEPORT
+            if (bReusePort)
+                acceptor.set_option(asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+#endif
+            acceptor.bind(endpoint);
+            acceptor.listen();
+        }
+
+        bool HasMessages(){
+            if (!m_deqUpdateBatch.empty())
+                return true;
+            for (auto& s : m_vShards)
+                if (!s->qMessagesIn.empty())
+                    return true;
+            return false;
+        }
+
+        // Hand up to nMaxMessages queued messages to OnMessage, stopping early once
+        // tDeadline has passed
+        size_t DispatchMessages(size_t nMaxMessages, std::chrono::steady_clock::time_point tDeadline = std::chrono::steady_clock::time_point::max()){
             size_t nMessageCount = 0;
+            bool bDrained = true;
+            bool bTimed = tDeadline != std::chrono::steady_clock::time_point::max();
             
-            while(nMessageCount < nMaxMessages and !m_qMessagesIn.empty()){
-                // Grab the front message
-                auto msg = m_qMessagesIn.pop_front();
-                
-                // Pass to message handler
-                OnMessage(msg.remote, msg.msg);
+            // Pull messages out of the shard queues in batches, each batch costs a single
+            // synchronisation with the connections filling that queue
+            while(nMessageCount < nMaxMessages and bDrained){
+                bDrained = false;
+                for (auto& s : m_vShards){
+                    if (nMessageCount >= nMaxMessages)
+                        break;
+
+                    // Whatever is left of the last batch goes first. It is older than
+                    // anything still queued on its shard, so every client keeps its order.
+                    if (m_deqUpdateBatch.empty() && s->qMessagesIn.drain(m_deqUpdateBatch, nMaxMessages - nMessageCount) == 0)
+                        continue;
 
-                nMessageCount++;
+                    while (!m_deqUpdateBatch.empty() && nMessageCount < nMaxMessages){
+                        if (bTimed && std::chrono::steady_clock::now() >= tDeadline)
+                            return nMessageCount;
+
+                        // Off the batch before the handler runs, a handler that throws
+                        // does not get the same message again
+                        owned_message<T> msg = std::move(m_deqUpdateBatch.front());
+                        m_deqUpdateBatch.pop_front();
+                        nMessageCount++;
+
+                        // Pass to message handler, or to the lane of the client on the handler threads
+                        if (m_pHandlers){
+                            uint64_t nKey = msg.remote ? msg.remote->GetID() : 0;
+                            m_pHandlers->push(nKey, std::move(msg));
+                        }
+                        else{
+                            HandleMessage(msg);
+                        }
+                    }
+                    bDrained = true;
+                }
+            }
+            return nMessageCount;
+        }
+
+        // Record how long the message waited, up to now, and pass it to OnMessage. Runs
+        // on the thread calling Update() or on a handler thread, so time spent waiting
+        // in a handler lane counts as well.
+        void HandleMessage(owned_message<T>& msg){
+            if constexpr (connection_metrics::bEnabled){
+                uint64_t nWaitedNs = connection_metrics::Now() - msg.nReceivedAt;
+                m_histDispatch.record(nWaitedNs);
+                if (msg.remote)
+                    msg.remote->Metrics().Dispatch(nWaitedNs);
+            }
+
+            OnMessage(msg.remote, msg.msg);
+        }
+
+        // Fold the counters of a connection leaving the registry into the server totals
+        void RetireMetrics(const connection<T>& client){
+            if constexpr (connection_metrics::bEnabled){
+                connection_metrics_snapshot c = client.GetMetrics();
+                std::scoped_lock lock(m_muxMetrics);
+                m_metricsRetired.Accumulate(c, false);
+            }
+        }
+
+        // Body of the metrics dump thread
+        void DumpMetrics(const std::string& sFile, std::chrono::milliseconds interval){
+            std::string sTemp = sFile + ".tmp";
+            while (true){
+                {
+                    std::ofstream file(sTemp, std::ios::trunc);
+                    file << GetMetrics();
+                }
+                std::rename(sTemp.c_str(), sFile.c_str());
+
+                std::unique_lock<std::mutex> ul(m_muxMetricsDump);
+                if (m_cvMetricsDump.wait_for(ul, interval, [this]{ return m_bStopMetricsDump; }))
+                    return;
             }
         }
     
@@ -132,12 +574,14 @@ class server_interface{
             return true;
         }
 
-        // Caled when a client appears to have disconnected
+        // Caled when a client appears to have disconnected. Usually on the thread sending
+        // to it, but on an io thread when the client timed out.
         virtual void OnClientDisconnect(std::shared_ptr<connection<T>> client){
 
         }
 
-        // Callend when a message arrives
+        // Callend when a message arrives, on the thread calling Update() or on a handler
+        // thread, see SetHandlerThreads()
         virtual void OnMessage(std::shared_ptr<connection<T>> client, message<T>& msg){
 
         }
@@ -148,20 +592,65 @@ class server_interface{
 
         }
 
+        // Called on an io thread when a client's outgoing queue reaches the high watermark.
+        // A good moment to stop producing for that client until the low watermark.
+        virtual void OnClientSendHighWatermark(std::shared_ptr<connection<T>> client){
+
+        }
+
+        // Called on an io thread when a client's outgoing queue has drained back down
+        // to the low watermark
+        virtual void OnClientSendLowWatermark(std::shared_ptr<connection<T>> client){
+
+        }
+
     protected:
-        // Thred safe queue for incoming message packets
-        tsqueue<owned_message<T>> m_qMessagesIn;
+        // Wakes Update() when any shard queue receives a message
+        queue_signal m_signalMessagesIn;
+
+        // Batch of messages being dispatched by Update(), kept to reuse its memory
+        std::deque<owned_message<T>> m_deqUpdateBatch;
+
+        // One shard in pool mode, one per io thread in sharded mode
+        std::vector<std::unique_ptr<shard>> m_vShards;
+        threading m_nThreading = threading::pool;
+        size_t m_nThreads = 1;
+        std::atomic<size_t> m_nNextShard{ 0 };
+
+        // Accepts outstanding on each acceptor, and connections pooled by each shard
+        size_t m_nAcceptsInFlight = 4;
+        static constexpr size_t nPooledConnections = 256;
+
+        // Write coalescing limits handed to every new connection
+        size_t m_nMaxWriteBytes = 64 * 1024;
+        size_t m_nMaxWriteBuffers = 64;
+
+        // Read mode handed to every new connection
+        typename connection<T>::read_mode m_nReadMode = connection<T>::read_mode::framed;
+
+        // Outgoing queue bounds handed to every new connection
+        typename connection<T>::send_limits m_sendLimits;
+
+        // Deadlines handed to every new connection
+        typename connection<T>::timeouts m_timeouts;
+        std::shared_ptr<const message<T>> m_pHeartbeat;
 
-        // Container of active validated connections
-        std::deque<std::shared_ptr<connection<T>>> m_deqConnections;
+        // Server wide latencies. Dispatch is written just before OnMessage, by the thread
+        // calling Update() or by the handler threads
+        latency_histogram<> m_histDispatch;
+        latency_histogram<> m_histHandshake;
 
-        // Order of declaration is important - it is also the order of initialization
-        asio::io_context m_asioContext;
-        std::thread m_threadContext;
+        // Totals of the connections that have left the registry
+        std::mutex m_muxMetrics;
+        server_metrics_snapshot m_metricsRetired;
 
-        // These things need an asio context
-        asio::ip::tcp::acceptor m_asioAcceptor;
+        // Periodic metrics report, written by a thread of its own
+        std::thread m_thrMetricsDump;
+        std::mutex m_muxMetricsDump;
+        std::condition_variable m_cvMetricsDump;
+        bool m_bStopMetricsDump = false;
 
-        //Clients will be identified via an ID
-        uint32_t nIDCounter = 1000;
+        // Optional handler threads, see SetHandlerThreads(). Last, so they are stopped
+        // before the shards holding the connections their messages point at go away.
+        std::unique_ptr<handler_pool<owned_message<T>>> m_pHandlers;
 };
\ No newline at end of file
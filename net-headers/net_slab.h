@@ -0,0 +1,135 @@
+#pragma once
+#include "net_common.h"
+
+// Counters describing how well a slab pool is serving allocations
+struct slab_pool_stats{
+    // Allocations served from the slab
+    uint64_t nHits = 0;
+    // Allocations that had to go to the heap, because the slab was used up or the
+    // object did not fit in a block
+    uint64_t nMisses = 0;
+    // Blocks currently handed out
+    uint64_t nInUse = 0;
+};
+
+// Fixed size block pool for objects that come and go in bursts, such as connections
+// during an accept storm. The first allocation carves a single slab of nBlocks blocks
+// the size of that allocation, after which allocating and releasing only pop and push
+// a free list threaded through the free blocks. Anything the slab cannot serve is left
+// to the caller, see slab_allocator. Blocks may be released on any thread.
+class slab_pool{
+    public:
+        explicit slab_pool(size_t nBlocks) : m_nBlocks(nBlocks){}
+
+        slab_pool(const slab_pool&) = delete;
+        slab_pool& operator=(const slab_pool&) = delete;
+
+        ~slab_pool(){
+            if (m_pSlab)
+                ::operator delete(m_pSlab, std::align_val_t(m_nAlign));
+        }
+
+        // A free block of at least nSize bytes aligned to nAlign, or nullptr
+        void* allocate(size_t nSize, size_t nAlign){
+            std::scoped_lock lock(m_muxPool);
+            if (!m_pSlab && m_nBlocks > 0)
+                Carve(nSize, nAlign);
+
+            if (m_pFree == nullptr || nSize > m_nBlockSize || nAlign > m_nAlign){
+                m_nMisses++;
+                return nullptr;
+            }
+
+            void* p = m_pFree;
+            m_pFree = *static_cast<void**>(p);
+            m_nHits++;
+            m_nInUse++;
+            return p;
+        }
+
+        // Take a block back. Returns false if p did not come from the slab.
+        bool release(void* p){
+            std::scoped_lock lock(m_muxPool);
+            uint8_t* pByte = static_cast<uint8_t*>(p);
+            if (m_pSlab == nullptr || pByte < m_pSlab || pByte >= m_pSlab + m_nBlocks * m_nBlockSize)
+                return false;
+
+            *static_cast<void**>(p) = m_pFree;
+            m_pFree = p;
+            m_nInUse--;
+            return true;
+        }
+
+        slab_pool_stats stats(){
+            std::scoped_lock lock(m_muxPool);
+            slab_pool_stats s;
+            s.nHits = m_nHits;
+            s.nMisses = m_nMisses;
+            s.nInUse = m_nInUse;
+            return s;
+        }
+
+    private:
+        // Allocate the slab and chain all of its blocks into the free list
+        void Carve(size_t nSize, size_t nAlign){
+            m_nAlign = std::max(nAlign, alignof(void*));
+            m_nBlockSize = (std::max(nSize, sizeof(void*)) + m_nAlign - 1) / m_nAlign * m_nAlign;
+            m_pSlab = static_cast<uint8_t*>(::operator new(m_nBlocks * m_nBlockSize, std::align_val_t(m_nAlign)));
+
+            for (size_t i = m_nBlocks; i-- > 0;){
+                void* p = m_pSlab + i * m_nBlockSize;
+                *static_cast<void**>(p) = m_pFree;
+                m_pFree = p;
+            }
+        }
+
+    private:
+        std::mutex m_muxPool;
+        const size_t m_nBlocks;
+        size_t m_nBlockSize = 0;
+        size_t m_nAlign = 0;
+        uint8_t* m_pSlab = nullptr;
+        void* m_pFree = nullptr;
+
+        uint64_t m_nHits = 0;
+        uint64_t m_nMisses = 0;
+        uint64_t m_nInUse = 0;
+};
+
+// Allocator drawing single objects from a slab_pool and falling back to the heap, for
+// std::allocate_shared. Every object shares ownership of the pool, so the pool lives
+// as long as the last of them.
+template<typename U>
+struct slab_allocator{
+    using value_type = U;
+
+    explicit slab_allocator(std::shared_ptr<slab_pool> pool) : pPool(std::move(pool)){}
+
+    template<typename V>
+    slab_allocator(const slab_allocator<V>& other) : pPool(other.pPool){}
+
+    U* allocate(size_t n){
+        if (n == 1){
+            if (void* p = pPool->allocate(sizeof(U), alignof(U)))
+                return static_cast<U*>(p);
+        }
+        return std::allocator<U>().allocate(n);
+    }
+
+    void deallocate(U* p, size_t n){
+        if (n != 1 || !pPool->release(p))
+            std::allocator<U>().deallocate(p, n);
+    }
+
+    template<typename V>
+    bool operator==(const slab_allocator<V>& other) const{
+        return pPool == other.pPool;
+    }
+
+    template<typename V>
+    bool operator!=(const slab_allocator<V>& other) const{
+        return pPool != other.pPool;
+    }
+
+    std::shared_ptr<slab_pool> pPool;
+};
@@ -0,0 +1,242 @@
+#pragma once
+#include "net_common.h"
+#include <functional>
+
+class timer_wheel;
+
+// Timer living on a timer_wheel. Embedded in whatever it times, so arming and
+// cancelling never allocate. Bound to its wheel and callback once, then armed and
+// cancelled any number of times, from any thread. The callback runs on the thread
+// driving the wheel, with the wheel locked: it must not arm, cancel or destroy any
+// timer itself, so it should only hand the work on, typically with asio::post.
+class wheel_timer{
+    public:
+        wheel_timer() = default;
+        wheel_timer(const wheel_timer&) = delete;
+        wheel_timer& operator=(const wheel_timer&) = delete;
+
+        ~wheel_timer(){
+            cancel();
+        }
+
+        void bind(std::shared_ptr<timer_wheel> pWheel, std::function<void()> fnExpired){
+            m_pWheel = std::move(pWheel);
+            m_fnExpired = std::move(fnExpired);
+        }
+
+        // Resolution of the wheel the timer is bound to
+        inline std::chrono::steady_clock::duration tick() const;
+
+        // (Re)start the timer, it fires once, delay from now
+        inline void arm(std::chrono::steady_clock::duration delay);
+
+        // Stop the timer if it is armed
+        inline void cancel();
+
+    private:
+        friend class timer_wheel;
+
+        std::shared_ptr<timer_wheel> m_pWheel;
+        std::function<void()> m_fnExpired;
+
+        // Intrusive slot list, guarded by the wheel's lock
+        wheel_timer* m_pPrev = nullptr;
+        wheel_timer* m_pNext = nullptr;
+        uint64_t m_nExpires = 0;
+        size_t m_nLevel = 0;
+        size_t m_nSlot = 0;
+        bool m_bLinked = false;
+};
+
+// Hierarchical timing wheel, in the style of the Linux kernel timers. Time advances in
+// fixed ticks. The lowest level has a slot for each of the next 64 ticks, and each
+// level above covers 64 times the span of the one below, so four levels reach 2^24
+// ticks (19 days at 100ms). Arming and cancelling are O(1): link or unlink the timer
+// in one slot. A timer on a higher level is moved down a level each time the level
+// below wraps around, and fires from the lowest one.
+// Thousands of connections can each keep a deadline for the price of one
+// asio::steady_timer, the wheel_ticker driving the wheel. Deadlines are only as
+// precise as the tick, they fire up to one tick late.
+class timer_wheel{
+    public:
+        static constexpr size_t nSlotBits = 6;
+        static constexpr size_t nSlots = size_t(1) << nSlotBits;
+        static constexpr size_t nLevels = 4;
+        static constexpr uint64_t nMaxTicks = (uint64_t(1) << (nSlotBits * nLevels)) - 1;
+
+        explicit timer_wheel(std::chrono::steady_clock::duration tick = std::chrono::milliseconds(100))
+            : m_tick(std::max(tick, std::chrono::steady_clock::duration(1))), m_tStart(std::chrono::steady_clock::now()){
+            for (auto& level : m_aSlots)
+                level.fill(nullptr);
+        }
+
+        timer_wheel(const timer_wheel&) = delete;
+        timer_wheel& operator=(const timer_wheel&) = delete;
+
+        std::chrono::steady_clock::duration tick() const{
+            return m_tick;
+        }
+
+        void arm(wheel_timer& timer, std::chrono::steady_clock::duration delay){
+            // Round up, a timer never fires early
+            auto tDue = std::chrono::steady_clock::now() + std::max(delay, std::chrono::steady_clock::duration(0)) - m_tStart;
+            uint64_t nDue = uint64_t((tDue + m_tick - std::chrono::steady_clock::duration(1)) / m_tick);
+
+            std::scoped_lock lock(m_muxWheel);
+            if (timer.m_bLinked)
+                Unlink(timer);
+            timer.m_nExpires = std::max(nDue, m_nTick);
+            Link(timer);
+        }
+
+        void cancel(wheel_timer& timer){
+            std::scoped_lock lock(m_muxWheel);
+            if (timer.m_bLinked)
+                Unlink(timer);
+        }
+
+        // Fire every timer due by tNow. Called by whatever drives the wheel.
+        void advance(std::chrono::steady_clock::time_point tNow){
+            uint64_t nNow = uint64_t(std::max(tNow - m_tStart, std::chrono::steady_clock::duration(0)) / m_tick);
+
+            std::scoped_lock lock(m_muxWheel);
+            while (m_nTick <= nNow)
+                Tick();
+        }
+
+        // Number of armed timers
+        size_t size(){
+            std::scoped_lock lock(m_muxWheel);
+            return m_nTimers;
+        }
+
+    private:
+        // Process the tick m_nTick, then move on to the next one
+        void Tick(){
+            size_t nIndex = size_t(m_nTick & (nSlots - 1));
+
+            // The lowest level has gone all the way round, so bring the next slot of
+            // the level above down, and so on up while levels wrap as well
+            if (nIndex == 0){
+                for (size_t nLevel = 1; nLevel < nLevels; nLevel++){
+                    size_t nSlot = size_t((m_nTick >> (nLevel * nSlotBits)) & (nSlots - 1));
+                    Cascade(nLevel, nSlot);
+                    if (nSlot != 0)
+                        break;
+                }
+            }
+
+            while (wheel_timer* pTimer = m_aSlots[0][nIndex]){
+                Unlink(*pTimer);
+                if (pTimer->m_fnExpired)
+                    pTimer->m_fnExpired();
+            }
+
+            m_nTick++;
+        }
+
+        // Relink every timer of a slot, which puts them on lower levels
+        void Cascade(size_t nLevel, size_t nSlot){
+            wheel_timer* pTimer = m_aSlots[nLevel][nSlot];
+            m_aSlots[nLevel][nSlot] = nullptr;
+            while (pTimer){
+                wheel_timer* pNext = pTimer->m_pNext;
+                m_nTimers--;
+                Link(*pTimer);
+                pTimer = pNext;
+            }
+        }
+
+        void Link(wheel_timer& timer){
+            uint64_t nDelta = std::min(timer.m_nExpires - m_nTick, nMaxTicks);
+            timer.m_nExpires = m_nTick + nDelta;
+
+            size_t nLevel = 0;
+            while (nLevel + 1 < nLevels && nDelta >= (uint64_t(1) << ((nLevel + 1) * nSlotBits)))
+                nLevel++;
+            size_t nSlot = size_t((timer.m_nExpires >> (nLevel * nSlotBits)) & (nSlots - 1));
+
+            wheel_timer*& pHead = m_aSlots[nLevel][nSlot];
+            timer.m_pPrev = nullptr;
+            timer.m_pNext = pHead;
+            if (pHead)
+                pHead->m_pPrev = &timer;
+            pHead = &timer;
+
+            timer.m_nLevel = nLevel;
+            timer.m_nSlot = nSlot;
+            timer.m_bLinked = true;
+            m_nTimers++;
+        }
+
+        void Unlink(wheel_timer& timer){
+            if (timer.m_pPrev)
+                timer.m_pPrev->m_pNext = timer.m_pNext;
+            else
+                m_aSlots[timer.m_nLevel][timer.m_nSlot] = timer.m_pNext;
+            if (timer.m_pNext)
+                timer.m_pNext->m_pPrev = timer.m_pPrev;
+
+            timer.m_pPrev = timer.m_pNext = nullptr;
+            timer.m_bLinked = false;
+            m_nTimers--;
+        }
+
+    private:
+        std::mutex m_muxWheel;
+        std::array<std::array<wheel_timer*, nSlots>, nLevels> m_aSlots;
+        // Next tick to process, counted from m_tStart
+        uint64_t m_nTick = 0;
+        size_t m_nTimers = 0;
+
+        const std::chrono::steady_clock::duration m_tick;
+        const std::chrono::steady_clock::time_point m_tStart;
+};
+
+std::chrono::steady_clock::duration wheel_timer::tick() const{
+    return m_pWheel->tick();
+}
+
+void wheel_timer::arm(std::chrono::steady_clock::duration delay){
+    m_pWheel->arm(*this, delay);
+}
+
+void wheel_timer::cancel(){
+    if (m_pWheel)
+        m_pWheel->cancel(*this);
+}
+
+// Drives a timer_wheel from an io_context, with one asio::steady_timer ticking for
+// as long as the context runs
+class wheel_ticker{
+    public:
+        wheel_ticker(asio::io_context& context, std::shared_ptr<timer_wheel> pWheel)
+            : m_timer(context), m_pWheel(std::move(pWheel)){}
+
+        // ASYNC - Start ticking, does nothing if already started
+        void start(){
+            if (m_bStarted.exchange(true))
+                return;
+            m_timer.expires_after(m_pWheel->tick());
+            Wait();
+        }
+
+    private:
+        void Wait(){
+            m_timer.async_wait([this](std::error_code ec){
+                if (ec)
+                    return;
+
+                m_pWheel->advance(std::chrono::steady_clock::now());
+
+                // Keep to the tick grid rather than drifting by the handler's latency
+                m_timer.expires_at(m_timer.expiry() + m_pWheel->tick());
+                Wait();
+            });
+        }
+
+    private:
+        asio::steady_timer m_timer;
+        std::shared_ptr<timer_wheel> m_pWheel;
+        std::atomic<bool> m_bStarted{ false };
+};
@@ -1,6 +1,61 @@
 #pragma once
 #include "net_common.h"
 
+// Lets a single consumer sleep until any one of several queues receives an item.
+// Queues attached to the signal notify it after every push, but only pay for the
+// mutex while the consumer is actually asleep.
+class queue_signal{
+    public:
+        // Called by producers after an item has been published
+        void notify(){
+            if (m_nWaiters.load(std::memory_order_seq_cst) > 0){
+                std::unique_lock<std::mutex> ul(muxBlocking);
+                cvBlocking.notify_all();
+            }
+        }
+
+        // Blocks until fnReady() returns true
+        template<typename Pred>
+        void wait(Pred fnReady){
+            Sleep(fnReady, [&](std::unique_lock<std::mutex>& ul){
+                cvBlocking.wait(ul, fnReady);
+                return true;
+            });
+        }
+
+        // Blocks until fnReady() returns true or the timeout expires.
+        // Returns the final value of fnReady().
+        template<typename Pred, typename Rep, typename Period>
+        bool wait_for(Pred fnReady, const std::chrono::duration<Rep, Period>& timeout){
+            return Sleep(fnReady, [&](std::unique_lock<std::mutex>& ul){
+                return cvBlocking.wait_for(ul, timeout, fnReady);
+            });
+        }
+
+    private:
+        // The waiter registers before checking fnReady, producers publish before checking
+        // for waiters, so one of the two always sees the other
+        template<typename Pred, typename Func>
+        bool Sleep(Pred fnReady, Func fnWait){
+            if (fnReady())
+                return true;
+
+            m_nWaiters.fetch_add(1, std::memory_order_seq_cst);
+            bool bReady;
+            {
+                std::unique_lock<std::mutex> ul(muxBlocking);
+                bReady = fnWait(ul);
+            }
+            m_nWaiters.fetch_sub(1, std::memory_order_relaxed);
+            return bReady;
+        }
+
+    private:
+        std::atomic<int> m_nWaiters{ 0 };
+        std::condition_variable cvBlocking;
+        std::mutex muxBlocking;
+};
+
 template<typename T>
 class tsqueue{
     public:
@@ -37,22 +92,59 @@ class tsqueue{
             return t;
         }
 
-        // Adds an item to back of the Queue
+        // Adds a copy of an item to back of the Queue
         void push_back(const T& item){
-            std::scoped_lock lock(muxQueue);
-            deqQueue.emplace_back(std::move(item));
+            emplace_back(item);
+        }
 
-            std::unique_lock<std::mutex> ul(muxBlocking);
+        // Moves an item to back of the Queue
+        void push_back(T&& item){
+            emplace_back(std::move(item));
+        }
+
+        // Constructs an item in place at back of the Queue
+        template<typename... Args>
+        void emplace_back(Args&&... args){
+            {
+                std::scoped_lock lock(muxQueue);
+                deqQueue.emplace_back(std::forward<Args>(args)...);
+            }
+            // The item is published under the same mutex the waiter checks under,
+            // so a waiter can never miss it, notifying after unlocking just saves it
+            // from waking up only to block on the mutex again
             cvBlocking.notify_one();
+            if (m_pSignal)
+                m_pSignal->notify();
         }
 
-        // Adds an item to front of the Queue
+        // Adds a copy of an item to front of the Queue
         void push_front(const T& item){
-            std::scoped_lock lock(muxQueue);
-            deqQueue.emplace_front(std::move(item));
+            emplace_front(item);
+        }
+
+        // Moves an item to front of the Queue
+        void push_front(T&& item){
+            emplace_front(std::move(item));
+        }
 
-            std::unique_lock<std::mutex> ul(muxBlocking);
+        // Constructs an item in place at front of the Queue
+        template<typename... Args>
+        void emplace_front(Args&&... args){
+            {
+                std::scoped_lock lock(muxQueue);
+                deqQueue.emplace_front(std::forward<Args>(args)...);
+            }
             cvBlocking.notify_one();
+            if (m_pSignal)
+                m_pSignal->notify();
+        }
+
+        // Moves up to nMax items, oldest first, onto the back of deqOut, taking the
+        // lock once. If everything fits into an empty deqOut the deques are simply swapped.
+        // Returns how many items were moved.
+        size_t drain(std::deque<T>& deqOut, size_t nMax = size_t(-1)){
+            std::scoped_lock lock(muxQueue);
+            return DrainLocked(deqOut, nMax);
         }
 
         // Returns true if Queue has no items
@@ -73,17 +165,64 @@ class tsqueue{
             deqQueue.clear();
         }
 
+        // Also notify pSignal whenever an item is pushed. Must be set before
+        // any producer starts pushing.
+        void attach(queue_signal* pSignal){
+            m_pSignal = pSignal;
+        }
+
+        // Blocks until the Queue has at least one item
         void wait(){
-            while(empty()){
-                std::unique_lock<std::mutex> ul(muxBlocking);
-                cvBlocking.wait(ul);
+            std::unique_lock<std::mutex> ul(muxQueue);
+            cvBlocking.wait(ul, [this]{ return !deqQueue.empty(); });
+        }
+
+        // Blocks until the Queue has at least one item or the timeout expires.
+        // Returns true if the Queue has items.
+        template<typename Rep, typename Period>
+        bool wait_for(const std::chrono::duration<Rep, Period>& timeout){
+            std::unique_lock<std::mutex> ul(muxQueue);
+            return cvBlocking.wait_for(ul, timeout, [this]{ return !deqQueue.empty(); });
+        }
+
+        // Blocks until the Queue has at least one item or the deadline passes.
+        // Returns true if the Queue has items.
+        template<typename Clock, typename Duration>
+        bool wait_until(const std::chrono::time_point<Clock, Duration>& deadline){
+            std::unique_lock<std::mutex> ul(muxQueue);
+            return cvBlocking.wait_until(ul, deadline, [this]{ return !deqQueue.empty(); });
+        }
+
+        // Waits up to timeout for items, then moves up to nMax of them onto deqOut
+        // under the same lock. Returns how many items were moved, 0 on timeout.
+        template<typename Rep, typename Period>
+        size_t pop_batch_wait(std::deque<T>& deqOut, size_t nMax, const std::chrono::duration<Rep, Period>& timeout){
+            std::unique_lock<std::mutex> ul(muxQueue);
+            if (!cvBlocking.wait_for(ul, timeout, [this]{ return !deqQueue.empty(); }))
+                return 0;
+            return DrainLocked(deqOut, nMax);
+        }
+
+    protected:
+        // drain() with muxQueue already held
+        size_t DrainLocked(std::deque<T>& deqOut, size_t nMax){
+            size_t nMoved = std::min(nMax, deqQueue.size());
+            if (deqOut.empty() && nMoved == deqQueue.size()){
+                deqOut.swap(deqQueue);
             }
+            else{
+                std::move(deqQueue.begin(), deqQueue.begin() + nMoved, std::back_inserter(deqOut));
+                deqQueue.erase(deqQueue.begin(), deqQueue.begin() + nMoved);
+            }
+            return nMoved;
         }
 
     protected:
+        // A single mutex guards the deque and is the one waiters sleep on
         std::mutex muxQueue;
         std::deque<T> deqQueue;
         std::condition_variable cvBlocking;
-        std::mutex muxBlocking;
 
+        // Optional signal shared with other queues
+        queue_signal* m_pSignal = nullptr;
 };
\ No newline at end of file